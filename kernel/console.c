@@ -126,6 +126,20 @@ consoleread(int user_dst, uint64 dst, int n)
   return target - n;
 }
 
+//
+// non-zero if consoleread() would not have to wait.
+//
+int
+consolepoll(void)
+{
+  int ready;
+
+  acquire(&cons.lock);
+  ready = cons.r != cons.w;
+  release(&cons.lock);
+  return ready;
+}
+
 //
 // the console input interrupt handler.
 // uartintr() calls this for input character.
@@ -170,6 +184,7 @@ consoleintr(int c)
         // has arrived.
         cons.w = cons.e;
         wakeup(&cons.r);
+        pollwakeup();
       }
     }
     break;
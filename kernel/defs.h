@@ -21,6 +21,7 @@ void            bunpin(struct buf*);
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
+int             consolepoll(void);
 
 // exec.c
 int             exec(char*, char**);
@@ -33,6 +34,10 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filepoll(struct file*, int);
+uint            pollseq(void);
+int             pollwait(uint);
+void            pollwakeup(void);
 
 // fs.c
 void            fsinit(int);
@@ -63,6 +68,10 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kzalloc(void);
+int             kzrefill(void);
+void            krefinc(void *);
+int             krefcount(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -75,6 +84,7 @@ int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipepoll(struct pipe*, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -82,14 +92,25 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+extern struct spinlock fd_lock;
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             clone(uint64, uint64, uint64);
+int             join(void);
+void            reapthreads(struct proc*);
+void            vmlock(struct proc*);
+void            vmunlock(struct proc*);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             setpriority(int, int);
+int             getpriority(int);
+void            mlfqboost(void);
+int             sleepuntil(uint64);
+void            timerexpire(void);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -141,6 +162,9 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// start.c
+extern uint64   tickinterval;
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -168,12 +192,13 @@ int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
-void            uvminvalid(pagetable_t pagetable, uint64 va); // CSE 536
+uint64          uvminvalid(pagetable_t pagetable, uint64 va); // CSE 536
 
 // plic.c
 void            plicinit(void);
@@ -184,12 +209,20 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwpages(uint, char**, int, int);
 void            virtio_disk_intr(void);
 
 // CSE 536: pfault.c
 extern uint64   non_fault_addr;
 void            page_fault_handler(void);
+int             demand_page(pagetable_t, uint64);
+void            demand_range(uint64, uint64);
 void            proc_pswap_diskblocks_init(void);
+uint64          heap_grow(struct proc*, uint64, uint64);
+uint64          heap_shrink(struct proc*, uint64, uint64);
+void            heap_free(struct proc*);
+int             heap_guard(struct proc*, uint64);
+int             heap_copy(struct proc*, struct proc*);
 
 // CSE 536: debug.h
 void print_static_proc(char* name);
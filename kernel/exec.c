@@ -7,9 +7,6 @@
 #include "defs.h"
 #include "elf.h"
 
-// static 
-int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -27,11 +24,19 @@ exec(char *path, char **argv)
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *execip = 0;
   struct proghdr ph;
+  struct program_section sections[MAXPROGSECTIONS];
+  int nsections = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // The new image replaces the memory that threads run in,
+  // so only a leader may exec; its threads are ended once
+  // the new image is known to be good.
+  if(p->isthread)
+    return -1;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -50,7 +55,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments; page_fault_handler()
+  // reads each page in when it is first touched.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -62,20 +68,30 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr + ph.memsz >= MAXVA - 2*PGSIZE)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nsections >= MAXPROGSECTIONS)
       goto bad;
+
+    sections[nsections].startva = ph.vaddr;
+    sections[nsections].memsz = ph.memsz;
+    sections[nsections].off = ph.off;
+    sections[nsections].filesz = ph.filesz;
+    sections[nsections].perm = flags2perm(ph.flags);
+    nsections++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
+#ifdef KDEBUG
+    print_skip_section(p->name, ph.vaddr, ph.memsz);
+#endif
   }
-  iunlockput(ip);
+  // Keep the inode referenced for as long as the image runs.
+  iunlock(ip);
   end_op();
+  execip = ip;
   ip = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
@@ -122,13 +138,30 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image. The threads may still be
+  // growing the old one, so end them before looking at it.
+  reapthreads(p);
+  uint64 oldsz = p->sz;
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  p->alarm_interval = 0; // the old handler is gone
+  p->alarm_handler = 0;
+  memmove(p->sections, sections, sizeof(sections));
+  p->nsections = nsections;
   proc_freepagetable(oldpagetable, oldsz);
+  heap_free(p);
+  if(p->exec_ip){
+    begin_op();
+    iput(p->exec_ip);
+    end_op();
+  }
+  p->exec_ip = execip;
+#ifdef KDEBUG
+  print_ondemand_proc(p->name);
+#endif
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -139,31 +172,11 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(execip){
+    begin_op();
+    iput(execip);
+    end_op();
+  }
   return -1;
 }
 
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
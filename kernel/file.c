@@ -12,6 +12,12 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "poll.h"
+
+// Most bytes fileread() and filewrite() read in with
+// demand_range() before one copy: few enough heap pages
+// that reading in the last doesn't evict the first.
+#define FILECHUNK ((MAXRESHEAP/2) * PGSIZE)
 
 struct devsw devsw[NDEV];
 struct {
@@ -19,10 +25,19 @@ struct {
   struct file file[NFILE];
 } ftable;
 
+// Bumped whenever a pipe or the console may have become
+// readable or writable, so poll() need not sleep on every
+// file it is watching.
+struct {
+  struct spinlock lock;
+  uint seq;
+} pollstate;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  initlock(&pollstate.lock, "poll");
 }
 
 // Allocate a file structure.
@@ -106,22 +121,45 @@ filestat(struct file *f, uint64 addr)
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  int r = 0, i, n1;
 
   if(f->readable == 0)
     return -1;
 
+  // The copy to addr happens with the pipe, console or
+  // inode lock held, so read the buffer in first, a
+  // FILECHUNK at a time. A pipe or device may return
+  // short anyway, so it gets just one.
+  if(f->type != FD_INODE && n > FILECHUNK)
+    n = FILECHUNK;
+
   if(f->type == FD_PIPE){
+    demand_range(addr, n);
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
+    demand_range(addr, n);
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    i = 0;
+    while(i < n){
+      n1 = n - i;
+      if(n1 > FILECHUNK)
+        n1 = FILECHUNK;
+      demand_range(addr + i, n1);
+      ilock(f->ip);
+      if((r = readi(f->ip, 1, addr + i, f->off, n1)) > 0)
+        f->off += r;
+      iunlock(f->ip);
+      if(r <= 0)
+        break;
+      i += r;
+      if(r != n1)
+        break;
+    }
+    if(i > 0)
+      r = i;
   } else {
     panic("fileread");
   }
@@ -139,12 +177,31 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
-  if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
+  if(f->type == FD_PIPE || f->type == FD_DEVICE){
+    if(f->type == FD_DEVICE &&
+       (f->major < 0 || f->major >= NDEV || !devsw[f->major].write))
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    // The copy from addr happens with the pipe or console
+    // lock held, so read the buffer in first, a FILECHUNK
+    // at a time.
+    int i = 0;
+    r = 0;
+    while(i < n){
+      int n1 = n - i;
+      if(n1 > FILECHUNK)
+        n1 = FILECHUNK;
+      demand_range(addr + i, n1);
+      if(f->type == FD_PIPE)
+        r = pipewrite(f->pipe, addr + i, n1);
+      else
+        r = devsw[f->major].write(1, addr + i, n1);
+      if(r <= 0)
+        break;
+      i += r;
+      if(r != n1)
+        break;
+    }
+    ret = (i > 0 ? i : r);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
@@ -159,6 +216,8 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      // writei() copies with the inode lock held.
+      demand_range(addr + i, n1);
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -180,3 +239,65 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Return which of events (POLLIN, POLLOUT) f is ready for,
+// plus POLLHUP if it is a pipe whose other end is closed.
+int
+filepoll(struct file *f, int events)
+{
+  int revents = 0;
+
+  if(f->type == FD_PIPE){
+    revents = pipepoll(f->pipe, f->writable);
+  } else if(f->type == FD_DEVICE && f->major == CONSOLE){
+    if(consolepoll())
+      revents |= POLLIN;
+    revents |= POLLOUT;
+  } else {
+    // Inodes and other devices never block for long.
+    revents = POLLIN | POLLOUT;
+  }
+  if(!f->readable)
+    revents &= ~POLLIN;
+  if(!f->writable)
+    revents &= ~POLLOUT;
+  return revents & (events | POLLHUP);
+}
+
+// Current poll sequence number; see pollwait().
+uint
+pollseq(void)
+{
+  uint seq;
+
+  acquire(&pollstate.lock);
+  seq = pollstate.seq;
+  release(&pollstate.lock);
+  return seq;
+}
+
+// Sleep until pollwakeup() has been called since pollseq()
+// returned seq. Return -1 if killed.
+int
+pollwait(uint seq)
+{
+  acquire(&pollstate.lock);
+  while(pollstate.seq == seq){
+    if(killed(myproc())){
+      release(&pollstate.lock);
+      return -1;
+    }
+    sleep(&pollstate.seq, &pollstate.lock);
+  }
+  release(&pollstate.lock);
+  return 0;
+}
+
+// Called after a pipe or the console changes state.
+void
+pollwakeup(void)
+{
+  acquire(&pollstate.lock);
+  pollstate.seq++;
+  wakeup(&pollstate.seq);
+  release(&pollstate.lock);
+}
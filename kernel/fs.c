@@ -655,8 +655,11 @@ namex(char *path, int nameiparent, char *name)
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  else {
+    acquire(&fd_lock);
+    ip = idup(myproc()->leader->cwd);
+    release(&fd_lock);
+  }
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -18,15 +18,34 @@ struct run {
   struct run *next;
 };
 
-struct {
+// Each CPU allocates from and frees to its own list, so
+// CPUs rarely contend for a lock. A CPU that runs out takes
+// a batch of pages from another CPU's list.
+// Each CPU also keeps a pool of pages zeroed while it was
+// idle, for kzalloc().
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  struct run *zerolist;  // zeroed but for the link word
+  int nzero;
+};
+
+struct kmem kmem[NCPU];
+
+// Number of page tables mapping each physical page, once
+// fork() shares pages copy-on-write. Updated atomically,
+// since pages move freely between CPUs.
+int kref[(PHYSTOP - KERNBASE) / PGSIZE];
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+#define KSTEAL 32   // pages moved per steal
+#define KZPOOL 64   // zeroed pages each CPU keeps ready
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +54,98 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kref[PA2REF(p)] = 1;
     kfree(p);
+  }
 }
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// A page shared copy-on-write is freed only when its
+// last reference is dropped.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(n > 0)
+    return;
+  if(n < 0)
+    panic("kfree: free page");
+
+#ifdef KDEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  release(&km->lock);
+  pop_off();
+}
+
+// Move up to KSTEAL pages from another CPU's free list, or
+// if zero is set its zeroed pool, to the same list of km.
+// Return 0 if no other CPU had any.
+static int
+kstealfrom(struct kmem *km, int zero)
+{
+  struct kmem *victim;
+  struct run *first, *last, **list;
+  int n;
+
+  for(victim = kmem; victim < &kmem[NCPU]; victim++){
+    list = zero ? &victim->zerolist : &victim->freelist;
+    if(victim == km || *list == 0)
+      continue;
+    acquire(&victim->lock);
+    first = last = *list;
+    if(first == 0){
+      release(&victim->lock);
+      continue;
+    }
+    for(n = 1; n < KSTEAL && last->next; n++)
+      last = last->next;
+    *list = last->next;
+    if(zero)
+      victim->nzero -= n;
+    release(&victim->lock);
+
+    acquire(&km->lock);
+    list = zero ? &km->zerolist : &km->freelist;
+    last->next = *list;
+    *list = first;
+    if(zero)
+      km->nzero += n;
+    release(&km->lock);
+    return 1;
+  }
+  return 0;
+}
+
+// Refill km's free list from another CPU's. If none has
+// free pages and km's zeroed pool is empty too, take some
+// from another CPU's pool rather than fail.
+// Called with interrupts off, without km->lock held.
+static void
+ksteal(struct kmem *km)
+{
+  if(kstealfrom(km, 0) == 0 && km->zerolist == 0)
+    kstealfrom(km, 1);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +155,102 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem *km;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  if(km->freelist == 0)
+    ksteal(km);
+  acquire(&km->lock);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+  } else if((r = km->zerolist) != 0){
+    km->zerolist = r->next;
+    km->nzero--;
+  }
+  release(&km->lock);
+  pop_off();
 
+  if(r)
+    kref[PA2REF(r)] = 1;
+#ifdef KDEBUG
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
   return (void*)r;
 }
+
+// Add a reference to page pa, which is being shared.
+void
+krefinc(void *pa)
+{
+  __sync_fetch_and_add(&kref[PA2REF(pa)], 1);
+}
+
+// Number of references to page pa.
+int
+krefcount(void *pa)
+{
+  return __atomic_load_n(&kref[PA2REF(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Allocate one zeroed page, preferably from the pool
+// kzrefill() keeps, which saves zeroing it now.
+void *
+kzalloc(void)
+{
+  struct run *r;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r = km->zerolist;
+  if(r){
+    km->zerolist = r->next;
+    km->nzero--;
+  }
+  release(&km->lock);
+  pop_off();
+
+  if(r){
+    r->next = 0;
+    kref[PA2REF(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Zero one free page into this CPU's pool if it is low.
+// Called by the scheduler when it has nothing to run.
+// Return 1 if it did, 0 if the pool is full or memory is short.
+int
+kzrefill(void)
+{
+  struct run *r;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  r = 0;
+  if(km->nzero < KZPOOL){
+    acquire(&km->lock);
+    r = km->freelist;
+    if(r)
+      km->freelist = r->next;
+    release(&km->lock);
+  }
+  if(r){
+    memset((char*)r, 0, PGSIZE);
+    acquire(&km->lock);
+    r->next = km->zerolist;
+    km->zerolist = r;
+    km->nzero++;
+    release(&km->lock);
+  }
+  pop_off();
+  return r != 0;
+}
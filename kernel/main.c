@@ -2,6 +2,8 @@
 #include "param.h"
 #include "memlayout.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 
 volatile static int started = 0;
@@ -25,6 +27,7 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    proc_pswap_diskblocks_init(); // page save area
     iinit();         // inode table
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
@@ -41,5 +44,6 @@ main()
     plicinithart();   // ask PLIC for device interrupts
   }
 
+  mycpu()->online = 1; // new processes may be placed here
   scheduler();
 }
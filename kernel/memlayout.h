@@ -65,3 +65,7 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// clone()d threads share their leader's page table, so each
+// maps its trapframe at its own page below TRAPFRAME.
+#define TRAPFRAME_THREAD(p) (TRAPFRAME - ((p)+1)*PGSIZE)
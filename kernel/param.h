@@ -11,6 +11,10 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 // #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NMLFQ         3  // scheduling levels and priorities
+#define MLFQBOOST   100  // ticks between raising all processes to their top level
+#define TIMEBASE 10000000 // r_time() cycles per second (qemu virt)
+#define TICKHZ       10  // default timer interrupts per second; boot arg tickhz=
 #define FSSIZE       3000  // size of file system in blocks
 
 /* CSE 536: changed to 3000 to use the last 1000 blocks for page swapping. */
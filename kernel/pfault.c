@@ -0,0 +1,577 @@
+// Demand paging and swapping.
+//
+// exec() records the program's loadable ELF segments in the
+// process instead of loading them, and maps nothing but the
+// user stack. The first access to each page faults, and
+// page_fault_handler() reads that page in from the program's
+// inode.
+//
+// Heap pages grown by sbrk() are tracked in heap_tracker[]
+// and only allocated when first touched. Once more than
+// MAXRESHEAP of them are in memory, one chosen by CLOCK
+// replacement is written to the page save area (PSA) on
+// disk and unmapped; touching it again faults it back in.
+// Memory state belongs to the thread group's leader.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+// A swapped page takes PSABLOCKS consecutive blocks of
+// the PSA, which mkfs leaves out of the file system. PSA
+// I/O goes straight to the disk, not the buffer cache,
+// up to SWAPCLUSTER pages in one request.
+#define PSABLOCKS (PGSIZE / BSIZE)
+#define NPSASLOTS ((PSAEND - PSASTART) / PSABLOCKS)
+#define SWAPCLUSTER 4
+
+struct {
+  struct spinlock lock;
+  char used[NPSASLOTS];
+} psa;
+
+void
+proc_pswap_diskblocks_init(void)
+{
+  initlock(&psa.lock, "psa");
+}
+
+// Allocate room for n pages side by side in the PSA.
+// Return the first block, or -1 if there is no such room.
+static int
+psa_alloc(int n)
+{
+  int i, j;
+
+  acquire(&psa.lock);
+  for(i = 0; i + n <= NPSASLOTS; i++){
+    for(j = 0; j < n && !psa.used[i+j]; j++)
+      ;
+    if(j == n){
+      for(j = 0; j < n; j++)
+        psa.used[i+j] = 1;
+      release(&psa.lock);
+      return PSASTART + i*PSABLOCKS;
+    }
+    i += j;
+  }
+  release(&psa.lock);
+  return -1;
+}
+
+static void
+psa_free(int startblock)
+{
+  acquire(&psa.lock);
+  psa.used[(startblock - PSASTART) / PSABLOCKS] = 0;
+  release(&psa.lock);
+}
+
+// Find the tracked heap page at va. The tracked pages
+// are consecutive, so this is an index.
+static struct heap_tracker_t*
+heap_find(struct proc *l, uint64 va)
+{
+  uint64 i;
+
+  if(l->nheap == 0 || va < l->heap_tracker[0].addr)
+    return 0;
+  i = (va - l->heap_tracker[0].addr) / PGSIZE;
+  if(i >= l->nheap)
+    return 0;
+  return &l->heap_tracker[i];
+}
+
+// Choose a resident heap page to evict with the CLOCK
+// algorithm. The hand sweeps heap_tracker[], giving pages
+// referenced since its last visit (PTE_A set) a second chance
+// by clearing the bit. A clean page whose PSA copy is still
+// good is taken first, as dropping it needs no disk write;
+// after a full sweep without one, the first unreferenced
+// dirty page is taken instead.
+static struct heap_tracker_t*
+heap_victim(struct proc *l)
+{
+  struct heap_tracker_t *h, *dirty = 0;
+  pte_t *pte;
+
+  if(l->heap_hand >= l->nheap)
+    l->heap_hand = 0;
+  for(int n = 0; n < 2*l->nheap; n++){
+    if(n >= l->nheap && dirty)
+      break;
+    h = &l->heap_tracker[l->heap_hand];
+    l->heap_hand = (l->heap_hand + 1) % l->nheap;
+    if(!h->loaded)
+      continue;
+    if((pte = walk(l->pagetable, h->addr, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if(*pte & PTE_A){
+      // Atomically, as the hardware may be setting PTE_D.
+      __sync_fetch_and_and(pte, ~PTE_A);
+      l->heap_hits++;
+      continue;
+    }
+    if((*pte & PTE_D) == 0 && h->startblock >= 0)
+      return h;
+    if(dirty == 0)
+      dirty = h;
+  }
+  return dirty;
+}
+
+// Finish swapping out h, now that its page pa is unmapped
+// and its contents are at startblock in the PSA.
+static void
+heap_swapped(struct proc *l, struct heap_tracker_t *h, char *pa, int startblock)
+{
+  kfree(pa);
+#ifdef KDEBUG
+  print_evict_page(h->addr, startblock);
+#endif
+  h->startblock = startblock;
+  l->resident_heap_pages--;
+  l->heap_evicts++;
+}
+
+// Swap out up to SWAPCLUSTER resident heap pages chosen by
+// heap_victim() and free their memory. Clean pages with a
+// good PSA copy are just dropped. Dirty ones are written in
+// one disk request if the PSA has room for them side by
+// side, else one at a time; a page the PSA can't take goes
+// back into the page table. Return how many were evicted.
+static int
+heap_evict(struct proc *l)
+{
+  struct heap_tracker_t *v[SWAPCLUSTER], *w[SWAPCLUSTER];
+  char *pa[SWAPCLUSTER], *wpa[SWAPCLUSTER];
+  pte_t *pte;
+  int i, n, nw, startblock, evicted;
+
+  for(n = 0; n < SWAPCLUSTER; n++){
+    if((v[n] = heap_victim(l)) == 0)
+      break;
+    v[n]->loaded = false;
+    pa[n] = (char*)uvminvalid(l->pagetable, v[n]->addr);
+  }
+  if(n == 0)
+    return 0;
+  sfence_vma();
+
+  evicted = 0;
+  nw = 0;
+  for(i = 0; i < n; i++){
+    // Check PTE_D only now that the page can't be written.
+    pte = walk(l->pagetable, v[i]->addr, 0);
+    if(v[i]->startblock >= 0 && (*pte & PTE_D) == 0){
+      heap_swapped(l, v[i], pa[i], v[i]->startblock);
+      evicted++;
+      continue;
+    }
+    if(v[i]->startblock >= 0){
+      psa_free(v[i]->startblock);
+      v[i]->startblock = -1;
+    }
+    w[nw] = v[i];
+    wpa[nw++] = pa[i];
+  }
+
+  if(nw > 1 && (startblock = psa_alloc(nw)) >= 0){
+    virtio_disk_rwpages(startblock, wpa, nw, 1);
+    l->heap_writes += nw;
+    for(i = 0; i < nw; i++)
+      heap_swapped(l, w[i], wpa[i], startblock + i*PSABLOCKS);
+    return evicted + nw;
+  }
+  for(i = 0; i < nw; i++){
+    if((startblock = psa_alloc(1)) >= 0){
+      virtio_disk_rwpages(startblock, &wpa[i], 1, 1);
+      l->heap_writes++;
+      heap_swapped(l, w[i], wpa[i], startblock);
+      evicted++;
+    } else {
+      // uvminvalid() cleared only PTE_V, so this puts the
+      // mapping back exactly, PTE_COW and all.
+      pte = walk(l->pagetable, w[i]->addr, 0);
+      __sync_fetch_and_or(pte, PTE_V);
+      w[i]->loaded = true;
+    }
+  }
+  return evicted;
+}
+
+// Bring the heap page h into memory: a zeroed page the
+// first time it is touched, else its copy from the PSA.
+// A swap-in reads ahead the pages after h that went out to
+// the PSA slots after its own, in the same request, while
+// that stays within MAXRESHEAP. The PSA copies are kept, so
+// pages that stay clean can be dropped again without a write.
+static int
+heap_load(struct proc *l, struct heap_tracker_t *h)
+{
+  char *mem[SWAPCLUSTER];
+  struct heap_tracker_t *end = &l->heap_tracker[l->nheap];
+  int i, n;
+
+  // If nothing can be evicted, go over MAXRESHEAP
+  // rather than fail.
+  if(l->resident_heap_pages >= MAXRESHEAP)
+    heap_evict(l);
+
+  if(h->startblock < 0){
+    if((mem[0] = kzalloc()) == 0)
+      return -1;
+    n = 1;
+  } else {
+    if((mem[0] = kalloc()) == 0)
+      return -1;
+    for(n = 1; n < SWAPCLUSTER; n++){
+      if(h + n >= end || h[n].loaded || h[n].startblock != h->startblock + n*PSABLOCKS)
+        break;
+      if(l->resident_heap_pages + n >= MAXRESHEAP)
+        break;
+      if((mem[n] = kalloc()) == 0)
+        break;
+    }
+    virtio_disk_rwpages(h->startblock, mem, n, 0);
+    l->heap_misses++;
+  }
+
+  for(i = 0; i < n; i++){
+    if(mappages(l->pagetable, h[i].addr, PGSIZE, (uint64)mem[i], h[i].perm) != 0){
+      while(i < n)
+        kfree(mem[i++]);
+      break;
+    }
+#ifdef KDEBUG
+    if(h[i].startblock >= 0)
+      print_retrieve_page(h[i].addr, h[i].startblock);
+#endif
+    h[i].loaded = true;
+    h[i].last_load_time = l->heap_loads++;
+    l->resident_heap_pages++;
+  }
+  return h->loaded ? 0 : -1;
+}
+
+// Grow p's heap from oldsz to newsz. Nothing is allocated
+// yet: page_in() fills each page with zeros when it is first
+// touched. Caller must hold vmlock().
+// Return the new size, or 0 if the heap would be more than
+// MAXHEAP pages or reach the trapframes.
+uint64
+heap_grow(struct proc *p, uint64 oldsz, uint64 newsz)
+{
+  struct proc *l = p->leader;
+  struct heap_tracker_t *h;
+  uint64 a;
+
+  if(newsz < oldsz || newsz > TRAPFRAME_THREAD(NPROC-1))
+    return 0;
+  if(l->nheap + (PGROUNDUP(newsz) - PGROUNDUP(oldsz)) / PGSIZE > MAXHEAP)
+    return 0;
+  for(a = PGROUNDUP(oldsz); a < newsz; a += PGSIZE){
+    h = &l->heap_tracker[l->nheap++];
+    h->addr = a;
+    h->last_load_time = 0;
+    h->startblock = -1;
+    h->loaded = false;
+    h->perm = PTE_R | PTE_W | PTE_U;
+  }
+#ifdef KDEBUG
+  print_skip_heap_region(p->name, PGROUNDUP(oldsz), (PGROUNDUP(newsz) - PGROUNDUP(oldsz)) / PGSIZE);
+#endif
+  return newsz;
+}
+
+// Shrink p's heap from oldsz to newsz, freeing the pages'
+// memory and PSA blocks. Caller must hold vmlock().
+// Return the new size.
+uint64
+heap_shrink(struct proc *p, uint64 oldsz, uint64 newsz)
+{
+  struct proc *l = p->leader;
+  struct heap_tracker_t *h;
+
+  while(l->nheap > 0){
+    h = &l->heap_tracker[l->nheap - 1];
+    if(h->addr < PGROUNDUP(newsz))
+      break;
+    if(h->loaded)
+      l->resident_heap_pages--;
+    if(h->startblock >= 0)
+      psa_free(h->startblock);
+    l->nheap--;
+  }
+  return uvmdealloc(l->pagetable, oldsz, newsz);
+}
+
+// Remember that the heap page at va, made inaccessible from
+// user space by guardpage(), must stay so when it is first
+// touched or swapped back in. Caller must hold vmlock().
+// Return -1 if va is not a heap page.
+int
+heap_guard(struct proc *p, uint64 va)
+{
+  struct heap_tracker_t *h;
+
+  if((h = heap_find(p->leader, va)) == 0)
+    return -1;
+  h->perm &= ~PTE_U;
+  return 0;
+}
+
+// Forget leader p's heap when its memory is freed as a
+// whole, releasing the PSA blocks.
+void
+heap_free(struct proc *p)
+{
+  for(int i = 0; i < p->nheap; i++){
+    if(p->heap_tracker[i].startblock >= 0)
+      psa_free(p->heap_tracker[i].startblock);
+  }
+  p->nheap = 0;
+  p->resident_heap_pages = 0;
+  p->heap_loads = 0;
+  p->heap_hand = 0;
+  p->heap_hits = 0;
+  p->heap_misses = 0;
+  p->heap_evicts = 0;
+  p->heap_writes = 0;
+}
+
+// Copy p's heap bookkeeping to its fork child np, after
+// uvmcopy() has shared the pages in memory. The child gets
+// its own copy of each swapped-out page, in the PSA or, if
+// that is full, in memory. Caller must hold vmlock(p).
+// Return -1 if out of memory; freeproc(np) cleans up.
+int
+heap_copy(struct proc *p, struct proc *np)
+{
+  struct proc *l = p->leader;
+  struct heap_tracker_t *h, *nh;
+  char *mem = 0;
+  int i;
+
+  np->heap_loads = l->heap_loads;
+  np->resident_heap_pages = l->resident_heap_pages;
+  for(i = 0; i < l->nheap; i++){
+    h = &l->heap_tracker[i];
+    nh = &np->heap_tracker[i];
+    *nh = *h;
+    if(h->loaded){
+      // The parent's PSA copy stays the parent's.
+      nh->startblock = -1;
+    } else if(h->startblock >= 0){
+      if(mem == 0 && (mem = kalloc()) == 0)
+        return -1;
+      virtio_disk_rwpages(h->startblock, &mem, 1, 0);
+      if((nh->startblock = psa_alloc(1)) >= 0){
+        virtio_disk_rwpages(nh->startblock, &mem, 1, 1);
+      } else if(mappages(np->pagetable, h->addr, PGSIZE, (uint64)mem, h->perm) == 0){
+        // The PSA is full; the child keeps this one in memory.
+        mem = 0;
+        nh->loaded = true;
+        nh->last_load_time = np->heap_loads++;
+        np->resident_heap_pages++;
+      } else {
+        kfree(mem);
+        return -1;
+      }
+    }
+    np->nheap = i + 1;
+  }
+  if(mem)
+    kfree(mem);
+  return 0;
+}
+
+// Find the recorded program section containing va.
+static struct program_section*
+find_section(struct proc *p, uint64 va)
+{
+  struct proc *l = p->leader;
+
+  for(int i = 0; i < l->nsections; i++){
+    struct program_section *s = &l->sections[i];
+    if(va >= s->startva && va < s->startva + s->memsz)
+      return s;
+  }
+  return 0;
+}
+
+// Map the page at va into p's memory and fill it.
+// Return 0 on success, -1 if va is not part of p's
+// memory or there is no memory left.
+static int
+page_in(struct proc *p, uint64 va)
+{
+  struct proc *l = p->leader;
+  struct program_section *s;
+  struct heap_tracker_t *h;
+  pte_t *pte;
+  char *mem;
+  uint64 off, n;
+  int r;
+
+  va = PGROUNDDOWN(va);
+  if(va >= p->sz)
+    return -1;
+
+  vmlock(p);
+
+  // Another thread may have faulted on it first.
+  pte = walk(l->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    vmunlock(p);
+    return (*pte & PTE_U) ? 0 : -1;
+  }
+
+  if((h = heap_find(l, va)) != 0){
+    // A guard page is never brought in.
+    if((h->perm & PTE_U) == 0){
+      vmunlock(p);
+      return -1;
+    }
+    r = heap_load(l, h);
+    vmunlock(p);
+    return r;
+  }
+
+  if((s = find_section(p, va)) == 0){
+    vmunlock(p);
+    return -1;
+  }
+  if((mem = kzalloc()) == 0){
+    vmunlock(p);
+    return -1;
+  }
+
+  // The part of the page backed by the file; the rest is bss.
+  off = va - s->startva;
+  if(off < s->filesz){
+    n = s->filesz - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    ilock(l->exec_ip);
+    if(readi(l->exec_ip, 0, (uint64)mem, s->off + off, n) != n){
+      iunlock(l->exec_ip);
+      kfree(mem);
+      vmunlock(p);
+      return -1;
+    }
+    iunlock(l->exec_ip);
+#ifdef KDEBUG
+    print_load_seg(va, s->off + off, n);
+#endif
+  }
+
+  if(mappages(l->pagetable, va, PGSIZE, (uint64)mem, PTE_R | PTE_U | s->perm) != 0){
+    kfree(mem);
+    vmunlock(p);
+    return -1;
+  }
+  vmunlock(p);
+  return 0;
+}
+
+// Whether the PTE allows the access that raised scause.
+static int
+pte_allows(pte_t pte, uint64 scause)
+{
+  if((pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+    return 0;
+  if(scause == 12)
+    return (pte & PTE_X) != 0;
+  if(scause == 15)
+    return (pte & PTE_W) != 0;
+  return (pte & PTE_R) != 0;
+}
+
+// Handle an instruction (12), load (13) or store (15) page
+// fault from user space: copy a copy-on-write page, or read
+// in a page that hasn't been touched yet or was swapped out. Kill the process
+// if the address isn't part of its memory.
+void
+page_fault_handler(void)
+{
+  struct proc *p = myproc();
+  uint64 scause = r_scause();
+  uint64 va = r_stval();
+  pte_t *pte;
+
+  // Reading the page in may sleep on the disk.
+  intr_on();
+
+#ifdef KDEBUG
+  print_page_fault(p->name, PGROUNDDOWN(va));
+#endif
+
+  if(va >= MAXVA)
+    goto bad;
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V) && scause == 15 && (*pte & PTE_COW)){
+    if(uvmcow(p->pagetable, va) == 0)
+      return;
+    // Unless another thread swapped it out meanwhile.
+    if(*pte & PTE_V)
+      goto bad;
+  }
+  if(pte && (*pte & PTE_V)){
+    // Mapped by another thread since the fault, a hart
+    // that leaves PTE_A and PTE_D to software, or a
+    // genuine protection fault.
+    if(pte_allows(*pte, scause)){
+      __sync_fetch_and_or(pte, scause == 15 ? PTE_A | PTE_D : PTE_A);
+      return;
+    }
+    goto bad;
+  }
+  if(page_in(p, va) == 0)
+    return;
+
+ bad:
+  printf("usertrap(): page fault scause %p pid=%d\n", scause, p->pid);
+  printf("            sepc=%p stval=%p\n", r_sepc(), va);
+  setkilled(p);
+}
+
+// Make the page at va of the current process present, for
+// copyin() and copyout(). Return -1 if it can't be.
+int
+demand_page(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  // Reading the page in sleeps, which is not allowed
+  // with a spinlock held.
+  if(p == 0 || pagetable != p->pagetable || va >= MAXVA || mycpu()->noff > 0)
+    return -1;
+  return page_in(p, va);
+}
+
+// Make the user range [va, va+len) present before a copy that
+// happens with a spinlock or the file's inode lock held, where
+// page_in() could not sleep or would deadlock. Errors are left
+// for the copy to report.
+void
+demand_range(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 a;
+
+  if(len == 0 || va + len < va)
+    return;
+  for(a = PGROUNDDOWN(va); a < va + len && a < p->sz; a += PGSIZE){
+    if(walkaddr(p->pagetable, a) == 0)
+      page_in(p, a);
+  }
+}
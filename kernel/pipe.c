@@ -7,6 +7,7 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "poll.h"
 
 #define PIPESIZE 512
 
@@ -66,6 +67,7 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwakeup();
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
     kfree((char*)pi);
@@ -87,6 +89,7 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
     }
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
       wakeup(&pi->nread);
+      pollwakeup();
       sleep(&pi->nwrite, &pi->lock);
     } else {
       char ch;
@@ -97,6 +100,7 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
     }
   }
   wakeup(&pi->nread);
+  pollwakeup();
   release(&pi->lock);
 
   return i;
@@ -125,6 +129,30 @@ piperead(struct pipe *pi, uint64 addr, int n)
       break;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pollwakeup();
   release(&pi->lock);
   return i;
 }
+
+// Readiness of pi for poll(): POLLIN or POLLOUT for the end
+// given by writable, and POLLHUP if the other end is closed.
+int
+pipepoll(struct pipe *pi, int writable)
+{
+  int revents = 0;
+
+  acquire(&pi->lock);
+  if(writable){
+    if(!pi->readopen)
+      revents |= POLLHUP;
+    else if(pi->nwrite != pi->nread + PIPESIZE)
+      revents |= POLLOUT;
+  } else {
+    if(pi->nread != pi->nwrite)
+      revents |= POLLIN;
+    if(!pi->writeopen)
+      revents |= POLLIN | POLLHUP;
+  }
+  release(&pi->lock);
+  return revents;
+}
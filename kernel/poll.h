@@ -0,0 +1,10 @@
+#define POLLIN    0x001   // Readable without blocking
+#define POLLOUT   0x002   // Writable without blocking
+#define POLLHUP   0x004   // Other end of a pipe closed (revents only)
+#define POLLNVAL  0x008   // Not an open fd (revents only)
+
+struct pollfd {
+  int fd;        // File descriptor to check
+  short events;  // Conditions of interest
+  short revents; // Conditions that hold
+};
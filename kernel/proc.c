@@ -17,6 +17,9 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
+static void wakeproc(struct proc *p);
+static int runqidlest(void);
 
 extern char trampoline[]; // trampoline.S
 
@@ -26,6 +29,61 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
+// protects p->vmbusy, which serializes changes to an
+// address space shared by clone()d threads.
+struct spinlock vm_lock;
+
+// protects the open file table and current directory of
+// a leader, which its clone()d threads use too.
+struct spinlock fd_lock;
+
+// per-CPU queues of RUNNABLE processes. a process is put
+// on one whenever it becomes RUNNABLE, and taken off by the
+// scheduler that runs it; a CPU takes work from the
+// busiest queue when that is two longer than its own, or
+// its own is empty (see runqnext()). must be acquired
+// after p->lock.
+//
+// each queue has NMLFQ levels, a multilevel feedback queue:
+// the scheduler runs the first process of the highest
+// non-empty level. a process that uses up its time slice
+// at a level (MLFQSLICE ticks) moves down one; one that
+// sleeps before then moves up one when woken. every
+// MLFQBOOST ticks all go back to their top level, so none
+// starves. a process's priority caps how high it can go.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NMLFQ];
+  struct proc *tail[NMLFQ];
+  int n;
+} runqs[NCPU];
+
+#define MLFQSLICE(level) (1 << (level))
+#define MLFQTOP(p) (NMLFQ - 1 - (p)->priority)
+
+int mlfqepoch;    // counts boosts
+
+// processes sleeping on a channel are kept in the wait
+// queue the channel hashes to, so that wakeup() only looks
+// at those. a process is on one exactly while SLEEPING.
+// must be acquired after p->lock.
+#define NWAITQ 64
+#define WAITQ(chan) (&waitqs[((uint64)(chan) * 0x9E3779B97F4A7C15UL) >> 58])
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitqs[NWAITQ];
+
+// processes in sleepuntil(), sorted by deadline, so that a
+// timer interrupt need only look at the first. must be
+// acquired before p->lock.
+struct {
+  struct spinlock lock;
+  struct proc *head;
+  uint64 first;     // head's deadline, or ~0; read without lock
+} timerq;
+
 // Allocate a page for each process's kernel stack.
 // Map it high in memory, followed by an invalid
 // guard page.
@@ -51,6 +109,14 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  initlock(&vm_lock, "vm_lock");
+  initlock(&fd_lock, "fd_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runqs[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitqs[i].lock, "waitq");
+  initlock(&timerq.lock, "timerq");
+  timerq.first = ~0UL;
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -105,9 +171,11 @@ allocpid()
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
+// If leader is non-zero, the new proc is a thread sharing
+// leader's page table; the caller must hold leader's vmlock().
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct proc *leader)
 {
   struct proc *p;
 
@@ -124,6 +192,10 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->priority = NMLFQ - 1;
+  p->level = 0;
+  p->slice = 0;
+  p->boosted = mlfqepoch;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -132,12 +204,29 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(leader == 0){
+    p->leader = p;
+    p->trapframe_va = TRAPFRAME;
+
+    // An empty user page table.
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+  } else {
+    // Map this thread's trapframe into the shared page table.
+    p->leader = leader;
+    p->isthread = 1;
+    p->trapframe_va = TRAPFRAME_THREAD((int) (p - proc));
+    if(mappages(leader->pagetable, p->trapframe_va, PGSIZE,
+                (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->pagetable = leader->pagetable;
   }
 
   // Set up new context to start executing at forkret,
@@ -155,12 +244,25 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  if(p->isthread){
+    // The page table belongs to the leader.
+    if(p->pagetable)
+      uvmunmap(p->pagetable, p->trapframe_va, 1, 0);
+  } else if(p->pagetable){
+    proc_freepagetable(p->pagetable, p->sz);
+    heap_free(p);
+  }
+  p->pagetable = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
+  p->trapframe_va = 0;
+  p->leader = 0;
+  p->isthread = 0;
+  p->alarm_interval = 0;
+  p->alarm_ticks = 0;
+  p->alarm_handler = 0;
+  p->nsections = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -234,7 +336,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
@@ -249,12 +351,52 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  p->rqcpu = 0;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
+// Serialize changes to the address space p shares with its
+// thread group, such as growing it or mapping a new thread.
+// May sleep, so must not be called holding a spinlock.
+void
+vmlock(struct proc *p)
+{
+  struct proc *l = p->leader;
+
+  acquire(&vm_lock);
+  while(l->vmbusy)
+    sleep(&l->vmbusy, &vm_lock);
+  l->vmbusy = 1;
+  release(&vm_lock);
+}
+
+void
+vmunlock(struct proc *p)
+{
+  struct proc *l = p->leader;
+
+  acquire(&vm_lock);
+  l->vmbusy = 0;
+  wakeup(&l->vmbusy);
+  release(&vm_lock);
+}
+
+// Set the size of the memory shared by p's thread group.
+static void
+setsz(struct proc *p, uint64 sz)
+{
+  struct proc *pp;
+
+  for(pp = proc; pp < &proc[NPROC]; pp++){
+    if(pp->leader == p->leader)
+      pp->sz = sz;
+  }
+}
+
 // Grow or shrink user memory by n bytes.
+// Caller must hold vmlock().
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -267,13 +409,13 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if((sz = heap_grow(p, sz, sz + n)) == 0) {
       return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    sz = heap_shrink(p, sz, sz + n);
   }
-  p->sz = sz;
+  setsz(p, sz);
   return 0;
 }
 
@@ -286,18 +428,36 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // Keep other threads from changing memory while it is copied.
+  vmlock(p);
+
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
+    vmunlock(p);
     return -1;
   }
+  // np is USED, so nothing else touches it, and heap_copy()
+  // sleeps on the disk, which it can't with np->lock held.
+  release(&np->lock);
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child. Set the size
+  // first, so that freeproc() unmaps whatever was copied
+  // before a failure.
+  np->sz = p->sz;
+  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0 ||
+     heap_copy(p, np) < 0){
+    acquire(&np->lock);
     freeproc(np);
     release(&np->lock);
+    vmunlock(p);
     return -1;
   }
-  np->sz = p->sz;
+
+  // Pages not yet touched are read in from the same program.
+  memmove(np->sections, p->leader->sections, sizeof(np->sections));
+  np->nsections = p->leader->nsections;
+  if(p->leader->exec_ip)
+    np->exec_ip = idup(p->leader->exec_ip);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -306,23 +466,82 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
+  acquire(&fd_lock);
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+    if(p->leader->ofile[i])
+      np->ofile[i] = filedup(p->leader->ofile[i]);
+  np->cwd = idup(p->leader->cwd);
+  release(&fd_lock);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  vmunlock(p);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->priority = p->priority;
+  np->level = MLFQTOP(np);
+  np->rqcpu = runqidlest();
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a thread that shares the caller's page table and
+// starts running fn(arg) in user space on the given stack.
+// fn must not return; the thread ends by calling exit().
+// The thread shares its leader's open file table and
+// current directory rather than holding copies of them.
+int
+clone(uint64 fn, uint64 stack, uint64 arg)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if(stack == 0 || stack % 16 != 0 || stack > p->sz)
+    return -1;
+
+  vmlock(p);
+  if((np = allocproc(p->leader)) == 0){
+    vmunlock(p);
+    return -1;
+  }
+  np->sz = p->sz;
+
+  // start at fn(arg) with the caller's other registers.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+  np->trapframe->ra = 0;
+
+  // np leaves ofile[] and cwd empty and uses its leader's,
+  // which outlive it: the leader reaps its threads before
+  // closing them in exit().
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
   release(&np->lock);
+  vmunlock(p);
 
   acquire(&wait_lock);
   np->parent = p;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  np->priority = p->priority;
+  np->level = MLFQTOP(np);
+  np->rqcpu = runqidlest();
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -343,9 +562,45 @@ reparent(struct proc *p)
   }
 }
 
+// Kill the other threads sharing leader p's address space,
+// wait for them to exit, and free them, whoever their
+// parent is. Afterwards p is the only user of its memory.
+void
+reapthreads(struct proc *p)
+{
+  struct proc *pp;
+  int alive;
+
+  acquire(&wait_lock);
+  for(;;){
+    alive = 0;
+    for(pp = proc; pp < &proc[NPROC]; pp++){
+      if(pp == p || pp->leader != p)
+        continue;
+      acquire(&pp->lock);
+      if(pp->leader == p){
+        if(pp->state == ZOMBIE){
+          freeproc(pp);
+        } else {
+          alive = 1;
+          pp->killed = 1;
+          if(pp->state == SLEEPING)
+            wakeproc(pp);
+        }
+      }
+      release(&pp->lock);
+    }
+    if(!alive)
+      break;
+    // Exiting threads wake up their leader.
+    sleep(p, &wait_lock);
+  }
+  release(&wait_lock);
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
-// until its parent calls wait().
+// until its parent calls wait(), or join() for a thread.
 void
 exit(int status)
 {
@@ -354,7 +609,12 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
+  // A leader takes its threads down with it, since
+  // they run in its memory.
+  if(!p->isthread)
+    reapthreads(p);
+
+  // Close all open files. A thread's are its leader's.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
       struct file *f = p->ofile[fd];
@@ -364,17 +624,25 @@ exit(int status)
   }
 
   begin_op();
-  iput(p->cwd);
+  if(p->cwd)
+    iput(p->cwd);
+  if(p->exec_ip)
+    iput(p->exec_ip);
   end_op();
   p->cwd = 0;
+  p->exec_ip = 0;
 
   acquire(&wait_lock);
 
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
+  // Parent might be sleeping in wait() or join().
   wakeup(p->parent);
+
+  // Leader might be sleeping in reapthreads().
+  if(p->isthread)
+    wakeup(p->leader);
   
   acquire(&p->lock);
 
@@ -388,22 +656,28 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(uint64 addr)
+// Wait for a child to exit and return its pid. Children
+// created by clone() are waited for only if threads is set,
+// and other children only if it is not.
+// Return -1 if this process has no such children.
+static int
+waitchild(uint64 addr, int threads)
 {
   struct proc *pp;
   int havekids, pid;
   struct proc *p = myproc();
 
+  // The status is copied out with locks held.
+  if(addr != 0)
+    demand_range(addr, sizeof(int));
+
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
     for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
+      if(pp->parent == p && pp->isthread == threads){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
@@ -437,6 +711,206 @@ wait(uint64 addr)
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(uint64 addr)
+{
+  return waitchild(addr, 0);
+}
+
+// Wait for a thread created by clone() to exit and
+// return its pid. Return -1 if there are no such threads.
+int
+join(void)
+{
+  return waitchild(0, 1);
+}
+
+// Append p to level of rq. Caller must hold rq->lock.
+static void
+runqappend(struct runq *rq, struct proc *p, int level)
+{
+  p->rqnext = 0;
+  if(rq->tail[level])
+    rq->tail[level]->rqnext = p;
+  else
+    rq->head[level] = p;
+  rq->tail[level] = p;
+}
+
+// There is new work on runqs[id]. Wake CPU id if it is
+// idle, or else another idle CPU to steal it, unless id is
+// this CPU and will run it next. An idle CPU's timer is
+// stopped (see idle()); setting it to now makes it take a
+// timer interrupt at once.
+static void
+runqkick(int id)
+{
+  int i;
+
+  __sync_synchronize();
+  if(!cpus[id].idle){
+    if(id == cpuid() && runqs[id].n <= 1)
+      return;
+    for(i = 0; i < NCPU && !cpus[i].idle; i++)
+      ;
+    if(i == NCPU)
+      return;
+    id = i;
+  }
+  *(uint64*)CLINT_MTIMECMP(id) = r_time();
+}
+
+// Make p RUNNABLE and put it at the tail of the run queue
+// of the CPU it last ran on, whose cache may still hold it.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runqs[p->rqcpu];
+
+  if(p->boosted != mlfqepoch){
+    p->boosted = mlfqepoch;
+    p->level = MLFQTOP(p);
+    p->slice = 0;
+  }
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  runqappend(rq, p, p->level);
+  rq->n++;
+  release(&rq->lock);
+  runqkick(p->rqcpu);
+}
+
+// Take the process at the head of the highest non-empty
+// level of rq, or return 0. Sets *level to that level.
+static struct proc*
+runqget(struct runq *rq, int *level)
+{
+  struct proc *p = 0;
+
+  acquire(&rq->lock);
+  for(int l = 0; l < NMLFQ; l++){
+    if((p = rq->head[l]) != 0){
+      rq->head[l] = p->rqnext;
+      if(rq->head[l] == 0)
+        rq->tail[l] = 0;
+      rq->n--;
+      *level = l;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Move every queued process back up to its top level.
+// Called by clockintr() every MLFQBOOST ticks; processes
+// that aren't queued notice mlfqepoch in setrunnable().
+void
+mlfqboost(void)
+{
+  struct runq *rq;
+  struct proc *p, *list;
+  int l;
+
+  __sync_fetch_and_add(&mlfqepoch, 1);
+  for(rq = runqs; rq < &runqs[NCPU]; rq++){
+    acquire(&rq->lock);
+    for(l = 1; l < NMLFQ; l++){
+      list = rq->head[l];
+      rq->head[l] = rq->tail[l] = 0;
+      while((p = list) != 0){
+        list = p->rqnext;
+        // p->priority is read without p->lock; a stale
+        // value only misplaces p until it next runs.
+        runqappend(rq, p, MLFQTOP(p) < l ? MLFQTOP(p) : l);
+      }
+    }
+    release(&rq->lock);
+  }
+}
+
+// The online CPU with the shortest run queue, for a new
+// process. The lengths are read without locks; it only
+// needs to be a good guess. Caller must have interrupts off.
+static int
+runqidlest(void)
+{
+  int best = cpuid();
+
+  for(int i = 0; i < NCPU; i++)
+    if(cpus[i].online && runqs[i].n < runqs[best].n)
+      best = i;
+  return best;
+}
+
+// Choose the next process for CPU id: the head of its own
+// run queue, unless the longest other queue has at least
+// two more, or its own is empty; then take one from that
+// queue instead, to even them out. Return 0 if all are empty.
+static struct proc*
+runqnext(int id, int *level)
+{
+  struct proc *p;
+  int i, busiest = -1;
+
+  for(i = 0; i < NCPU; i++){
+    if(i != id && runqs[i].n > 0 && (busiest < 0 || runqs[i].n > runqs[busiest].n))
+      busiest = i;
+  }
+  if(busiest >= 0 && runqs[busiest].n >= runqs[id].n + 2 &&
+     (p = runqget(&runqs[busiest], level)) != 0)
+    return p;
+  if((p = runqget(&runqs[id], level)) != 0)
+    return p;
+  if(busiest >= 0)
+    return runqget(&runqs[busiest], level);
+  return 0;
+}
+
+// Is every run queue empty?
+static int
+runqsempty(void)
+{
+  int i;
+
+  for(i = 0; i < NCPU && runqs[i].n == 0; i++)
+    ;
+  return i == NCPU;
+}
+
+// Nothing to run on CPU id. Rather than take a timer
+// interrupt every tick, set its timer for the next
+// sleepuntil() deadline, or a second from now at most, and
+// wait for an interrupt: that, a device, or runqkick().
+static void
+idle(int id)
+{
+  struct cpu *c = mycpu();
+  uint64 next;
+
+  // wfi still wakes for a pending interrupt with them off,
+  // and the interrupt is taken by intr_on() afterwards.
+  intr_off();
+  next = r_time() + TIMEBASE;
+  if(timerq.first < next)
+    next = timerq.first;
+  c->idle = 1;
+  *(uint64*)CLINT_MTIMECMP(id) = next;
+
+  // Look again, now that runqkick() would see c->idle and
+  // the timer write above can't undo its kick.
+  __sync_synchronize();
+  if(runqsempty())
+    asm volatile("wfi");
+
+  c->idle = 0;
+  *(uint64*)CLINT_MTIMECMP(id) = r_time() + tickinterval;
+  intr_on();
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -449,28 +923,48 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
+  int level;
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+    if((p = runqnext(id, &level)) == 0){
+      // Nothing to run: fill the pool of zeroed pages
+      // for later, then wait for something to do. Stop
+      // as soon as there is work, and don't sleep in
+      // idle() with the pool still short.
+      while(runqsempty() && kzrefill())
+        ;
+      if(runqsempty())
+        idle(id);
+      continue;
+    }
+
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->rqcpu = id;
+      // mlfqboost() or setpriority() may have moved it.
+      if(level < MLFQTOP(p))
+        level = MLFQTOP(p);
+      if(level != p->level){
+        p->level = level;
+        p->slice = 0;
       }
-      release(&p->lock);
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
   }
 }
 
@@ -502,13 +996,20 @@ sched(void)
 }
 // 6029263314
 
-// Give up the CPU for one scheduling round.
+// Give up the CPU for one scheduling round, at the end
+// of a timer tick. A process that has run for its whole
+// time slice drops a level.
 void
 yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  if(++p->slice >= MLFQSLICE(p->level)){
+    if(p->level < NMLFQ - 1)
+      p->level++;
+    p->slice = 0;
+  }
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -549,14 +1050,18 @@ sleep(void *chan, struct spinlock *lk)
   // so it's okay to release lk.
 
   acquire(&p->lock);  //DOC: sleeplock1
-  release(lk);
 
-  // Go to sleep.
+  // Go to sleep. Join the wait queue before releasing lk,
+  // since wakeup() finds sleepers there without p->lock.
   p->chan = chan;
   p->state = SLEEPING;
+  struct waitq *wq = WAITQ(chan);
+  acquire(&wq->lock);
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
 
-  /* Adil: sleeping. */
-  // printf("Sleeping and yielding CPU.");
+  release(lk);
 
   sched();
 
@@ -568,22 +1073,120 @@ sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
+// Sleep until r_time() reaches deadline.
+// Return -1 if killed first.
+int
+sleepuntil(uint64 deadline)
+{
+  struct proc *p = myproc();
+  struct proc **pp;
+  int r = 0;
+
+  if(r_time() >= deadline)
+    return 0;
+
+  acquire(&timerq.lock);
+  p->deadline = deadline;
+  for(pp = &timerq.head; *pp && (*pp)->deadline <= deadline; pp = &(*pp)->tqnext)
+    ;
+  p->tqnext = *pp;
+  *pp = p;
+  timerq.first = timerq.head->deadline;
+
+  // timerexpire() clears p->deadline when it takes p off.
+  while(p->deadline){
+    if(killed(p)){
+      for(pp = &timerq.head; *pp != p; pp = &(*pp)->tqnext)
+        ;
+      *pp = p->tqnext;
+      p->deadline = 0;
+      timerq.first = timerq.head ? timerq.head->deadline : ~0UL;
+      r = -1;
+      break;
+    }
+    sleep(&p->deadline, &timerq.lock);
+  }
+  release(&timerq.lock);
+  return r;
+}
+
+// Wake the processes whose sleepuntil() deadline has
+// passed. Called on every CPU's timer interrupt, so it
+// costs one comparison when none has.
+void
+timerexpire(void)
+{
+  struct proc *p;
+  uint64 now = r_time();
+
+  if(timerq.first > now)
+    return;
+
+  acquire(&timerq.lock);
+  while((p = timerq.head) != 0 && p->deadline <= now){
+    timerq.head = p->tqnext;
+    p->deadline = 0;
+    wakeup(&p->deadline);
+  }
+  timerq.first = timerq.head ? timerq.head->deadline : ~0UL;
+  release(&timerq.lock);
+}
+
+// Take sleeping p out of its wait queue and make it
+// RUNNABLE. Caller must hold p->lock.
+static void
+wakeproc(struct proc *p)
+{
+  struct waitq *wq = WAITQ(p->chan);
+  struct proc **pp;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext){
+    if(*pp == p){
+      *pp = p->wqnext;
+      break;
+    }
+  }
+  release(&wq->lock);
+
+  // It gave up the CPU before its time slice ran out.
+  if(p->level > MLFQTOP(p))
+    p->level--;
+  p->slice = 0;
+  setrunnable(p);
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
+  struct waitq *wq = WAITQ(chan);
+  struct proc *p, **pp, *woken[NPROC];
+  int i, n = 0;
+
+  // Take the sleepers off the queue, then make them
+  // RUNNABLE under their own locks.
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != 0; ){
+    if(p->chan == chan && p != myproc()){
+      *pp = p->wqnext;
+      woken[n++] = p;
+    } else {
+      pp = &p->wqnext;
     }
   }
+  release(&wq->lock);
+
+  for(i = 0; i < n; i++){
+    p = woken[i];
+    acquire(&p->lock);
+    // It may have been killed and gone back to sleep
+    // in between, so wakeproc() looks for it again.
+    if(p->state == SLEEPING && p->chan == chan)
+      wakeproc(p);
+    release(&p->lock);
+  }
 }
 
 // Kill the process with the given pid.
@@ -600,7 +1203,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        wakeproc(p);
       }
       release(&p->lock);
       return 0;
@@ -610,6 +1213,50 @@ kill(int pid)
   return -1;
 }
 
+// Set the priority of the process with the given pid, from
+// 0 to NMLFQ-1; higher runs first. The process can rise no
+// higher than level NMLFQ-1-priority.
+int
+setpriority(int pid, int priority)
+{
+  struct proc *p;
+
+  if(priority < 0 || priority >= NMLFQ)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      p->priority = priority;
+      if(p->level < MLFQTOP(p))
+        p->level = MLFQTOP(p);
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Return the priority of the process with the given pid,
+// or -1 if there is none.
+int
+getpriority(int pid)
+{
+  struct proc *p;
+  int priority;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      priority = p->priority;
+      release(&p->lock);
+      return priority;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 void
 setkilled(struct proc *p)
 {
@@ -685,6 +1332,10 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    if(p->nheap > 0)
+      printf(" heap %d/%d hits %d misses %d evicts %d writes %d",
+             p->resident_heap_pages, p->nheap, p->heap_hits,
+             p->heap_misses, p->heap_evicts, p->heap_writes);
     printf("\n");
   }
 }
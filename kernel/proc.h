@@ -27,6 +27,8 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // In idle() with its timer stopped.
+  int online;                 // Booted; runqidlest() may use it.
 };
 
 extern struct cpu cpus[NCPU];
@@ -84,6 +86,29 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE, PFAULT };
 
+// A loadable ELF segment of the running program, read in
+// a page at a time on first access (see pfault.c).
+struct program_section {
+  uint64 startva;              // Page-aligned user address
+  uint64 memsz;                // Bytes in memory
+  uint64 off;                  // Offset of the file-backed part in the ELF
+  uint64 filesz;               // Bytes backed by the file; the rest is zero
+  int perm;                    // PTE_X and/or PTE_W
+};
+
+#define MAXPROGSECTIONS 8
+
+// A page of heap grown by sbrk(). At most MAXRESHEAP of a
+// process's heap pages are in memory; the rest are kept in
+// the page save area (PSA) on disk (see pfault.c).
+struct heap_tracker_t {
+  uint64 addr;                 // Page-aligned user address
+  uint64 last_load_time;       // Order the page was brought in
+  int startblock;              // First PSA block with a copy, -1 if none
+  bool loaded;                 // In memory and mapped
+  int perm;                    // PTE permissions to map it with
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -94,17 +119,58 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int rqcpu;                   // CPU whose run queue it goes on
+  int priority;                // 0..NMLFQ-1, higher runs first; see setpriority()
+  int level;                   // Run queue level, 0 runs first
+  int slice;                   // Timer ticks used at this level
+  int boosted;                 // mlfqepoch when last raised to its top level
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // its run or wait queue's lock must be held when using these:
+  struct proc *rqnext;         // Next RUNNABLE process on the queue
+  struct proc *wqnext;         // Next process sleeping in the wait queue
+
+  // timerq.lock must be held when using these:
+  uint64 deadline;             // r_time() to wake at, 0 if not waiting
+  struct proc *tqnext;         // Next process on the timer queue
+
+  // vm_lock must be held when using this:
+  int vmbusy;                  // Address space is being changed (leader only)
+
+  // fd_lock must be held when using these, except by the leader
+  // reading its own; threads leave them empty and use the leader's:
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 trapframe_va;         // User address trapframe is mapped at
+  struct proc *leader;         // Owner of pagetable; self unless a thread
+  int isthread;                // Created by clone(), shares leader's memory
+  int alarm_interval;          // Ticks between upcalls, 0 if disabled
+  int alarm_ticks;             // Ticks since the last upcall
+  uint64 alarm_handler;        // User address of the upcall handler
+  struct inode *exec_ip;       // Program being run, pages in from here
+  int nsections;               // Entries used in sections[]
+  struct program_section sections[MAXPROGSECTIONS];
+  struct heap_tracker_t heap_tracker[MAXHEAP]; // Heap pages in address order
+  int nheap;                   // Entries used in heap_tracker[]
+  int resident_heap_pages;     // Entries that are loaded
+  uint64 heap_loads;           // Heap pages brought in so far
+  int heap_hand;               // CLOCK hand, an index into heap_tracker[]
+  int heap_hits;               // Referenced pages passed over by the hand
+  int heap_misses;             // Faults on swapped-out heap pages
+  int heap_evicts;             // Heap pages swapped out
+  int heap_writes;             // Swap-outs that had to write to the PSA
+  uint64 ucache_va;            // Last user page copyin/copyout translated,
+  uint64 ucache_pa;            //   its physical address, 0 if none,
+  uint64 ucache_gen;           //   vmgen when it was translated,
+  int ucache_write;            //   and whether it was checked for writing
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
 };
@@ -5,7 +5,7 @@
 #include "defs.h"
 
 void main();
-void timerinit();
+void timerinit(uint64 dtb);
 
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
@@ -13,12 +13,16 @@ __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 // a scratch area per CPU for machine-mode timer interrupts.
 uint64 timer_scratch[NCPU][5];
 
+// r_time() cycles between timer interrupts.
+uint64 tickinterval;
+
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
 
-// entry.S jumps here in machine mode on stack0.
+// entry.S jumps here in machine mode on stack0, with the
+// address of the device tree qemu made.
 void
-start()
+start(uint64 dtb)
 {
   // set M Previous Privilege mode to Supervisor, for mret.
   unsigned long x = r_mstatus();
@@ -38,13 +42,16 @@ start()
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // let supervisor mode read the time CSR, for r_time().
+  w_mcounteren(r_mcounteren() | 2);
+
   // configure Physical Memory Protection to give supervisor mode
   // access to all of physical memory.
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
   // ask for clock interrupts.
-  timerinit();
+  timerinit(dtb);
 
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
@@ -54,19 +61,86 @@ start()
   asm volatile("mret");
 }
 
+// big-endian 32-bit word of the device tree.
+static uint
+fdt32(uint64 a)
+{
+  uchar *b = (uchar*)a;
+  return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+// the kernel command line, which qemu -append puts in the
+// device tree's /chosen/bootargs, or 0 if there is none.
+static char*
+bootargs(uint64 dtb)
+{
+  uint64 p, strings;
+  uint tok, len;
+
+  if(dtb == 0 || fdt32(dtb) != 0xd00dfeed)
+    return 0;
+  p = dtb + fdt32(dtb + 8);
+  strings = dtb + fdt32(dtb + 12);
+  for(;;){
+    tok = fdt32(p);
+    p += 4;
+    if(tok == 1){
+      // begin node: NUL-terminated name, padded.
+      p += (strlen((char*)p) + 1 + 3) & ~3;
+    } else if(tok == 3){
+      // property: length, name offset, padded value.
+      len = fdt32(p);
+      if(strncmp((char*)(strings + fdt32(p + 4)), "bootargs", 9) == 0)
+        return (char*)(p + 8);
+      p += 8 + ((len + 3) & ~3);
+    } else if(tok != 2 && tok != 4){
+      // end of tree.
+      return 0;
+    }
+  }
+}
+
+// the value of name=N in the kernel command line, or -1.
+static int
+bootarg(uint64 dtb, char *name)
+{
+  char *s = bootargs(dtb);
+  int n = strlen(name), v;
+
+  while(s && *s){
+    if(strncmp(s, name, n) == 0 && s[n] == '='){
+      for(v = 0, s += n + 1; *s >= '0' && *s <= '9'; s++)
+        v = v*10 + *s - '0';
+      return v;
+    }
+    while(*s && *s != ' ')
+      s++;
+    while(*s == ' ')
+      s++;
+  }
+  return -1;
+}
+
 // arrange to receive timer interrupts.
 // they will arrive in machine mode at
 // at timervec in kernelvec.S,
 // which turns them into software interrupts for
 // devintr() in trap.c.
+// tickhz= on the command line (make TICKHZ=) sets how
+// many arrive per second.
 void
-timerinit()
+timerinit(uint64 dtb)
 {
   // each CPU has a separate source of timer interrupts.
   int id = r_mhartid();
+  int hz = bootarg(dtb, "tickhz");
+
+  if(hz < 1 || hz > 10000)
+    hz = TICKHZ;
+  tickinterval = TIMEBASE / hz;
 
   // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
+  uint64 interval = tickinterval; // cycles.
   *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
 
   // prepare information in scratch[] for timervec.
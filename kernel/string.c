@@ -4,10 +4,21 @@ void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w;
+
+  while(n > 0 && ((uint64)cdst & 7) != 0){
+    *cdst++ = c;
+    n--;
   }
+  // then a word at a time.
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(; n >= 8; n -= 8, cdst += 8)
+    *(uint64*)cdst = w;
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -43,9 +54,19 @@ memmove(void *dst, const void *src, uint n)
     d += n;
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    // a word at a time if src and dst line up.
+    if((((uint64)s ^ (uint64)d) & 7) == 0){
+      while(n > 0 && ((uint64)d & 7) != 0){
+        *d++ = *s++;
+        n--;
+      }
+      for(; n >= 8; n -= 8, d += 8, s += 8)
+        *(uint64*)d = *(const uint64*)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
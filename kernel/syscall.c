@@ -102,6 +102,15 @@ extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_ctime(void);
+extern uint64 sys_guardpage(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_sigalarm(void);
+extern uint64 sys_sigreturn(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_getpriority(void);
+extern uint64 sys_nanosleep(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -128,6 +137,15 @@ static uint64 (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_ctime]   sys_ctime,
+[SYS_guardpage] sys_guardpage,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_sigalarm]  sys_sigalarm,
+[SYS_sigreturn] sys_sigreturn,
+[SYS_poll]    sys_poll,
+[SYS_setpriority] sys_setpriority,
+[SYS_getpriority] sys_getpriority,
+[SYS_nanosleep] sys_nanosleep,
 };
 
 void
@@ -136,6 +154,7 @@ syscall(void)
   int num;
   struct proc *p = myproc();
   num = p->trapframe->a7;
+  p->ucache_pa = 0; // translations are cached per call
   
   /* Adil: debugging */
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
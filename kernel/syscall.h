@@ -21,3 +21,12 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_ctime  22
+#define SYS_guardpage 23
+#define SYS_clone  24
+#define SYS_join   25
+#define SYS_sigalarm  26
+#define SYS_sigreturn 27
+#define SYS_poll   28
+#define SYS_setpriority 29
+#define SYS_getpriority 30
+#define SYS_nanosleep 31
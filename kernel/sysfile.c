@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "poll.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -25,7 +26,7 @@ argfd(int n, int *pfd, struct file **pf)
   struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE || (f=myproc()->leader->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -40,14 +41,17 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
+  acquire(&fd_lock);
   for(fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd] == 0){
       p->ofile[fd] = f;
+      release(&fd_lock);
       return fd;
     }
   }
+  release(&fd_lock);
   return -1;
 }
 
@@ -99,10 +103,18 @@ sys_close(void)
 {
   int fd;
   struct file *f;
+  struct proc *p = myproc()->leader;
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  // another thread of the group may have closed fd meanwhile.
+  acquire(&fd_lock);
+  if(p->ofile[fd] != f){
+    release(&fd_lock);
+    return -1;
+  }
+  p->ofile[fd] = 0;
+  release(&fd_lock);
   fileclose(f);
   return 0;
 }
@@ -410,8 +422,8 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode *ip;
-  struct proc *p = myproc();
+  struct inode *ip, *old;
+  struct proc *p = myproc()->leader;
   
   begin_op();
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
@@ -425,9 +437,12 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
-  end_op();
+  acquire(&fd_lock);
+  old = p->cwd;
   p->cwd = ip;
+  release(&fd_lock);
+  iput(old);
+  end_op();
   return 0;
 }
 
@@ -488,18 +503,63 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      p->leader->ofile[fd0] = 0;
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    p->leader->ofile[fd0] = 0;
+    p->leader->ofile[fd1] = 0;
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   return 0;
-}
\ No newline at end of file
+}
+
+// poll(fds, nfds, block): fill in revents for each of the nfds
+// entries of fds and return how many are non-zero. If none are
+// and block is set, wait until one is.
+uint64
+sys_poll(void)
+{
+  uint64 ufds;
+  int nfds, block, i, n;
+  uint seq;
+  struct pollfd fds[NOFILE];
+  struct file *f;
+  struct proc *p = myproc();
+
+  argaddr(0, &ufds);
+  argint(1, &nfds);
+  argint(2, &block);
+  if(nfds < 0 || nfds > NOFILE)
+    return -1;
+  if(copyin(p->pagetable, (char*)fds, ufds, nfds * sizeof(fds[0])) < 0)
+    return -1;
+
+  for(;;){
+    // Sample the sequence number first, so that a change after
+    // the checks below ends pollwait() at once.
+    seq = pollseq();
+    n = 0;
+    for(i = 0; i < nfds; i++){
+      if(fds[i].fd < 0 || fds[i].fd >= NOFILE || (f = p->leader->ofile[fds[i].fd]) == 0)
+        fds[i].revents = POLLNVAL;
+      else
+        fds[i].revents = filepoll(f, fds[i].events);
+      if(fds[i].revents)
+        n++;
+    }
+    if(n > 0 || !block)
+      break;
+    if(pollwait(seq) < 0)
+      return -1;
+  }
+
+  if(copyout(p->pagetable, ufds, (char*)fds, nfds * sizeof(fds[0])) < 0)
+    return -1;
+  return n;
+}
@@ -35,15 +35,77 @@ sys_wait(void)
   return wait(p);
 }
 
+uint64
+sys_clone(void)
+{
+  uint64 fn, stack, arg;
+
+  argaddr(0, &fn);
+  argaddr(1, &stack);
+  argaddr(2, &arg);
+  return clone(fn, stack, arg);
+}
+
+uint64
+sys_join(void)
+{
+  return join();
+}
+
+// Call handler in user space every interval timer ticks
+// that the caller spends running, or stop if interval is 0.
+uint64
+sys_sigalarm(void)
+{
+  int interval;
+  uint64 handler;
+  struct proc *p = myproc();
+
+  argint(0, &interval);
+  argaddr(1, &handler);
+  if(interval < 0)
+    return -1;
+  p->alarm_interval = handler ? interval : 0;
+  p->alarm_handler = handler;
+  p->alarm_ticks = 0;
+  return 0;
+}
+
+// Resume the registers an upcall saved at frame. tp is left
+// alone, so that a user-level scheduler may resume the frame
+// on a different thread than the one it was taken from.
+uint64
+sys_sigreturn(void)
+{
+  uint64 frame;
+  struct trapframe saved;
+  struct proc *p = myproc();
+
+  argaddr(0, &frame);
+  if(copyin(p->pagetable, (char *)&saved, frame, sizeof(saved)) < 0)
+    return -1;
+  saved.kernel_satp = p->trapframe->kernel_satp;
+  saved.kernel_sp = p->trapframe->kernel_sp;
+  saved.kernel_trap = p->trapframe->kernel_trap;
+  saved.kernel_hartid = p->trapframe->kernel_hartid;
+  saved.tp = p->trapframe->tp;
+  *p->trapframe = saved;
+  return p->trapframe->a0;
+}
+
 uint64
 sys_sbrk(void)
 {
   uint64 addr;
-  int n;
+  int n, r;
+  struct proc *p = myproc();
 
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  vmlock(p);
+  addr = p->sz;
+  r = growproc(n);
+  vmunlock(p);
+  if(r < 0)
     return -1;
 
   return addr;
@@ -53,20 +115,22 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n < 0)
+    n = 0;
+  return sleepuntil(r_time() + (uint64)n * tickinterval);
+}
+
+// Sleep for at least the given number of nanoseconds, to
+// the next timer interrupt after that.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns, nspercycle = 1000000000 / TIMEBASE;
+
+  argaddr(0, &ns);
+  return sleepuntil(r_time() + (ns + nspercycle - 1) / nspercycle);
 }
 
 uint64
@@ -78,8 +142,26 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
-// since start.
+uint64
+sys_setpriority(void)
+{
+  int pid, priority;
+
+  argint(0, &pid);
+  argint(1, &priority);
+  return setpriority(pid, priority);
+}
+
+uint64
+sys_getpriority(void)
+{
+  int pid;
+
+  argint(0, &pid);
+  return getpriority(pid);
+}
+
+// return how many clock ticks have passed since start.
 uint64
 sys_uptime(void)
 {
@@ -95,4 +177,32 @@ uint64
 sys_ctime(void)
 {
   return r_time();
-}
\ No newline at end of file
+}
+
+// Make one page of the caller's memory inaccessible from
+// user space, e.g. as a guard below a thread stack. A heap
+// page sbrk() hasn't allocated yet is marked so that it
+// never will be.
+uint64
+sys_guardpage(void)
+{
+  uint64 va;
+  pte_t *pte;
+  int mapped;
+  struct proc *p = myproc();
+
+  argaddr(0, &va);
+  if(va % PGSIZE != 0 || va >= p->sz)
+    return -1;
+  vmlock(p);
+  pte = walk(p->pagetable, va, 0);
+  mapped = pte && (*pte & PTE_V);
+  if(mapped)
+    uvmclear(p->pagetable, va);
+  if(heap_guard(p, va) < 0 && !mapped){
+    vmunlock(p);
+    return -1;
+  }
+  vmunlock(p);
+  return 0;
+}
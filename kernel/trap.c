@@ -15,6 +15,7 @@ extern char trampoline[], uservec[], userret[];
 void kernelvec();
 
 extern int devintr();
+static void upcall(struct proc*);
 
 void
 trapinit(void)
@@ -67,6 +68,9 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault: copy-on-write, or a page not read in yet
+    page_fault_handler();
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -79,12 +83,40 @@ usertrap(void)
     exit(-1);
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  if(which_dev == 2){
+    if(p->alarm_interval && ++p->alarm_ticks >= p->alarm_interval){
+      p->alarm_ticks = 0;
+      upcall(p);
+    }
     yield();
+  }
 
   usertrapret();
 }
 
+//
+// Divert p to its sigalarm() handler. The interrupted user
+// registers are pushed on the user stack as a struct trapframe
+// and the handler is called with its address, which it passes
+// to sigreturn() to resume. Upcalls nest like any other call,
+// so the handler may switch stacks before calling sigreturn().
+//
+static void
+upcall(struct proc *p)
+{
+  struct trapframe *tf = p->trapframe;
+  uint64 sp = (tf->sp - sizeof(struct trapframe)) & ~0xfUL;
+
+  if(copyout(p->pagetable, sp, (char *)tf, sizeof(struct trapframe)) < 0){
+    setkilled(p);
+    return;
+  }
+  tf->epc = p->alarm_handler;
+  tf->sp = sp;
+  tf->a0 = sp;
+  tf->ra = 0;
+}
+
 //
 // return to user space
 //
@@ -121,6 +153,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
+  // tell uservec in trampoline.S where the trapframe is mapped.
+  w_sscratch(p->trapframe_va);
+
   // tell trampoline.S the user page table to switch to.
   uint64 satp = MAKE_SATP(p->pagetable);
 
@@ -128,7 +163,7 @@ usertrapret(void)
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, p->trapframe_va);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -165,13 +200,23 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Bring ticks up to date. Idle CPUs take no timer
+// interrupts, so every CPU calls this and ticks is worked
+// out from r_time() rather than counted.
 void
 clockintr()
 {
+  uint t = r_time() / tickinterval, old;
+
+  if(t == ticks)
+    return;
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  old = ticks;
+  if(t > ticks)
+    ticks = t;
   release(&tickslock);
+  if(t > old && t / MLFQBOOST != old / MLFQBOOST)
+    mlfqboost();
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -210,9 +255,8 @@ devintr()
     // software interrupt from a machine-mode timer interrupt,
     // forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
+    clockintr();
+    timerexpire();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
@@ -47,7 +47,8 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// enough for a swap cluster and a block transfer at once.
+#define NUM 16
 
 // a single descriptor, from the spec.
 struct virtq_desc {
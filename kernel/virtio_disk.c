@@ -47,6 +47,7 @@ static struct disk {
   // indexed by first descriptor index of chain.
   struct {
     struct buf *b;
+    int pages;   // or pages of a virtio_disk_rwpages() request
     char status;
   } info[NUM];
 
@@ -196,12 +197,12 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// block transfers use three descriptors.
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -226,7 +227,7 @@ virtio_disk_rw(struct buf *b, int write)
   // allocate the three descriptors.
   int idx[3];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, 3) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
@@ -291,6 +292,79 @@ virtio_disk_rw(struct buf *b, int write)
   release(&disk.vdisk_lock);
 }
 
+// read or write n whole pages, to or from consecutive disk
+// blocks starting at blockno, in a single request with one
+// data descriptor per page. for swapping, which keeps its
+// blocks out of the buffer cache.
+void
+virtio_disk_rwpages(uint blockno, char **pages, int n, int write)
+{
+  uint64 sector = blockno * (BSIZE / 512);
+  int idx[NUM];
+
+  if(n < 1 || n > NUM - 2)
+    panic("virtio_disk_rwpages");
+
+  acquire(&disk.vdisk_lock);
+
+  // a header descriptor, n data descriptors, and a status.
+  while(1){
+    if(allocn_desc(idx, n + 2) == 0) {
+      break;
+    }
+    sleep(&disk.free[0], &disk.vdisk_lock);
+  }
+
+  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+
+  if(write)
+    buf0->type = VIRTIO_BLK_T_OUT;
+  else
+    buf0->type = VIRTIO_BLK_T_IN;
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  disk.desc[idx[0]].addr = (uint64) buf0;
+  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  disk.desc[idx[0]].next = idx[1];
+
+  for(int i = 0; i < n; i++){
+    disk.desc[idx[1+i]].addr = (uint64) pages[i];
+    disk.desc[idx[1+i]].len = PGSIZE;
+    disk.desc[idx[1+i]].flags = write ? 0 : VRING_DESC_F_WRITE;
+    disk.desc[idx[1+i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[1+i]].next = idx[2+i];
+  }
+
+  disk.info[idx[0]].status = 0xff;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE;
+  disk.desc[idx[n+1]].next = 0;
+
+  disk.info[idx[0]].b = 0;
+  disk.info[idx[0]].pages = n;
+
+  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+
+  __sync_synchronize();
+
+  disk.avail->idx += 1;
+
+  __sync_synchronize();
+
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+
+  while(disk.info[idx[0]].pages != 0) {
+    sleep(&disk.info[idx[0]], &disk.vdisk_lock);
+  }
+
+  free_chain(idx[0]);
+
+  release(&disk.vdisk_lock);
+}
+
 void
 virtio_disk_intr()
 {
@@ -317,8 +391,13 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    if(b){
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+    } else {
+      disk.info[id].pages = 0;   // virtio_disk_rwpages() is done
+      wakeup(&disk.info[id]);
+    }
 
     disk.used_idx += 1;
   }
@@ -19,6 +19,21 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// serializes changes to copy-on-write PTEs.
+struct spinlock cow_lock;
+
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+
+// bumped whenever a user PTE is removed or pointed at another
+// page, to drop the translations copyin() and copyout() cache.
+uint64 vmgen;
+
+static void
+vmgenbump(void)
+{
+  __sync_fetch_and_add(&vmgen, 1);
+}
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -31,6 +46,9 @@ kvmmake(void)
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, so that idle() and runqkick() can set timers.
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
@@ -57,6 +75,7 @@ kvmmake(void)
 void
 kvminit(void)
 {
+  initlock(&cow_lock, "cow");
   kernel_pagetable = kvmmake();
 }
 
@@ -86,24 +105,36 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A level-1 PTE may itself be a leaf mapping a 2 MB
+// superpage, in which case that PTE is returned.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but stop at the PTE of the given level,
+// for mapping superpages.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int leaflevel)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > leaflevel; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte; // a superpage
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(leaflevel, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -141,12 +172,15 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Kernel (non-PTE_U) mappings use a 2 MB
+// superpage wherever va and pa are aligned and the rest of
+// the range covers it; user memory is always in 4 KB pages.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, step;
   pte_t *pte;
 
   if(size == 0)
@@ -155,15 +189,23 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if((perm & PTE_U) == 0 && a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 &&
+       last - a >= MEGAPGSIZE - PGSIZE){
+      pte = walklevel(pagetable, a, 1, 1);
+      step = MEGAPGSIZE;
+    } else {
+      pte = walk(pagetable, a, 1);
+      step = PGSIZE;
+    }
+    if(pte == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(last - a < step)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += step;
+    pa += step;
   }
   return 0;
 }
@@ -182,7 +224,7 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue; // never touched, so never paged in
     if((*pte & PTE_V) == 0)
       continue;
       /* CSE 536: removed for on-demand allocation. */
@@ -195,6 +237,7 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     }
     *pte = 0;
   }
+  vmgenbump();
 }
 
 // create an empty user page table.
@@ -203,10 +246,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -220,8 +262,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -239,12 +280,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
   oldsz = PGROUNDUP(oldsz);
 
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -304,8 +344,9 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// The physical pages are shared, and writable ones are
+// made read-only copy-on-write in both page tables;
+// uvmcow() copies them when either side writes.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -314,23 +355,22 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    // Pages not paged in yet are paged in by the child.
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     pa = PTE2PA(*pte);
+    acquire(&cow_lock);
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    release(&cow_lock);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    krefinc((void*)pa);
   }
+  vmgenbump(); // the parent's pages are read-only now
   return 0;
 
  err:
@@ -338,6 +378,52 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Give pagetable its own writable copy of the copy-on-write
+// page at va, after a store to it faulted or before the kernel
+// writes to it. The last sharer just takes the page over.
+// Return 0 on success, -1 if va is not writable or out of memory.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  // Threads sharing pagetable may fault on the same page.
+  acquire(&cow_lock);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+    goto bad;
+  if((*pte & PTE_COW) == 0){
+    // Another thread got here first, or not a COW page.
+    release(&cow_lock);
+    return (*pte & PTE_W) ? 0 : -1;
+  }
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcount((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      goto bad;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    kfree((void*)pa);
+    vmgenbump();
+  }
+  release(&cow_lock);
+  return 0;
+
+ bad:
+  release(&cow_lock);
+  return -1;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -349,19 +435,74 @@ uvmclear(pagetable_t pagetable, uint64 va)
   if(pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
+  vmgenbump();
 }
 
 // CSE 536: mark a PTE invalid. For swapping 
-// pages in and out of memory.
-void
+// pages in and out of memory. Returns the physical
+// address the PTE mapped, which the caller now owns.
+uint64
 uvminvalid(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
+  uint64 pa;
   
+  // Keep uvmcow() from replacing the page underneath.
+  acquire(&cow_lock);
   pte = walk(pagetable, va, 0);
-  if(pte == 0)
+  if(pte == 0 || (*pte & PTE_V) == 0)
     panic("uvminvalid");
+  pa = PTE2PA(*pte);
   *pte &= ~PTE_V;
+  release(&cow_lock);
+  vmgenbump();
+  return pa;
+}
+
+// Translate user page va0 for a copy to (write) or from
+// it, faulting it in if need be. The calling process keeps
+// the last page it translated until its next system call or
+// until vmgen moves, which saves the walk when a syscall
+// copies a little at a time from the same page, as argument
+// fetching does. Return the physical address, or 0.
+static uint64
+uvmtranslate(pagetable_t pagetable, uint64 va0, int write)
+{
+  struct proc *p = myproc();
+  uint64 pa, gen;
+  pte_t *pte;
+
+  if(va0 >= MAXVA)
+    return 0;
+  gen = vmgen;
+  __sync_synchronize();
+  if(p && pagetable == p->pagetable && p->ucache_pa && p->ucache_va == va0 &&
+     p->ucache_gen == gen && (p->ucache_write || !write))
+    return p->ucache_pa;
+
+  if(walkaddr(pagetable, va0) == 0 && demand_page(pagetable, va0) < 0)
+    return 0;
+  if(write){
+    pte = walk(pagetable, va0, 0);
+    // Read-only text and data stay read-only to the kernel too.
+    if((*pte & (PTE_W | PTE_COW)) == 0)
+      return 0;
+    if((*pte & PTE_COW) && uvmcow(pagetable, va0) < 0)
+      return 0;
+    // The hardware doesn't see this write; the swapper
+    // must not drop the page as clean.
+    __sync_fetch_and_or(pte, PTE_D);
+  }
+  if((pa = walkaddr(pagetable, va0)) == 0)
+    return 0;
+
+  if(p && pagetable == p->pagetable){
+    p->ucache_va = va0;
+    p->ucache_pa = pa;
+    p->ucache_gen = gen;
+    p->ucache_write = write;
+  }
+  return pa;
 }
 
 // Copy from kernel to user.
@@ -374,7 +515,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmtranslate(pagetable, va0, 1);
     if (pa0 == 0){
       return -1;
     }
@@ -400,7 +541,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmtranslate(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -427,7 +568,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmtranslate(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -436,6 +577,18 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
     char *p = (char *) (pa0 + (srcva - va0));
     while(n > 0){
+      // a word at a time while none of its bytes is zero.
+      if(((uint64)p & 7) == 0 && n >= 8){
+        uint64 w = *(uint64 *)p;
+        if(((w - 0x0101010101010101UL) & ~w & 0x8080808080808080UL) == 0){
+          memmove(dst, p, 8);
+          n -= 8;
+          max -= 8;
+          p += 8;
+          dst += 8;
+          continue;
+        }
+      }
       if(*p == '\0'){
         *dst = '\0';
         got_null = 1;
@@ -0,0 +1,64 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+
+#include "user/ulthread.h"
+#include <stdarg.h>
+
+// ctime() counts the 10 MHz RISC-V time base under QEMU.
+#define NS_PER_TICK 100
+
+#define NSWITCH 100000
+#define NTHREADS 2
+#define NYIELD 200
+
+struct ulthread_context main_ctx, pong_ctx;
+char pong_stack[PGSIZE] __attribute__((aligned(16)));
+
+void pong(void) {
+    for (;;)
+        ulthread_context_switch(&pong_ctx, &main_ctx);
+}
+
+void ul_start_func(void) {
+    for (int i = 0; i < NYIELD; i++)
+        ulthread_yield();
+    ulthread_destroy();
+}
+
+void report(char *what, int ticks, int n) {
+    uint64 ns = (uint64)ticks * NS_PER_TICK;
+    printf("%s: %d in %d ticks, %d ns each\n", what, n, ticks, (int)(ns / n));
+}
+
+int
+main(int argc, char *argv[])
+{
+    uint64 start;
+
+    /* Bare switch primitive: one round trip is two switches */
+    pong_ctx.ra = (uint64)pong;
+    pong_ctx.sp = (uint64)pong_stack + sizeof(pong_stack);
+    start = ctime();
+    for (int i = 0; i < NSWITCH/2; i++)
+        ulthread_context_switch(&main_ctx, &pong_ctx);
+    report("context switches", ctime() - start, NSWITCH);
+
+    /* Whole yield path through the scheduler, without tracing */
+    ulthread_init(ROUNDROBIN);
+    ulthread_trace(TRACE_NONE);
+    uint64 args[6] = {0,0,0,0,0,0};
+    for (int i = 0; i < NTHREADS; i++)
+        ulthread_spawn((uint64) ul_start_func, args, -1, ULTHREAD_STACKSIZE);
+    start = ctime();
+    ulthread_schedule();
+    report("yields", ctime() - start, NTHREADS*NYIELD);
+
+    return 0;
+}
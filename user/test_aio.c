@@ -0,0 +1,78 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+
+#include "user/ulthread.h"
+#include <stdarg.h>
+
+#define NPIPES 3
+#define NMSGS 4
+
+int fds[NPIPES][2];
+int received[NPIPES];
+
+/* Reads until the writer closes its end */
+void reader_func(int idx) {
+    char c;
+    while (ulthread_read(fds[idx][0], &c, 1) == 1) {
+        if (c != 'a' + idx) {
+            printf("reader %d got '%c'\n", idx, c);
+            exit(1);
+        }
+        received[idx]++;
+    }
+    close(fds[idx][0]);
+    ulthread_destroy();
+}
+
+/* Readers run first and find nothing to read */
+void writer_func(int idx) {
+    char c = 'a' + idx;
+    for (int i = 0; i < NMSGS; i++) {
+        ulthread_yield();
+        if (ulthread_write(fds[idx][1], &c, 1) != 1) {
+            printf("writer %d failed\n", idx);
+            exit(1);
+        }
+    }
+    close(fds[idx][1]);
+    ulthread_destroy();
+}
+
+int
+main(int argc, char *argv[])
+{
+    /* Initialize the user-level threading library */
+    ulthread_init(ROUNDROBIN);
+
+    printf("Testing threads waiting on pipes:\n");
+
+    for (int i = 0; i < NPIPES; i++) {
+        if (pipe(fds[i]) < 0) {
+            printf("pipe failed\n");
+            exit(1);
+        }
+        uint64 args[6] = {i,0,0,0,0,0};
+        ulthread_spawn((uint64) reader_func, args, -1, ULTHREAD_STACKSIZE);
+    }
+    for (int i = 0; i < NPIPES; i++) {
+        uint64 args[6] = {i,0,0,0,0,0};
+        ulthread_spawn((uint64) writer_func, args, -1, ULTHREAD_STACKSIZE);
+    }
+    ulthread_schedule();
+
+    for (int i = 0; i < NPIPES; i++) {
+        if (received[i] != NMSGS) {
+            printf("reader %d got %d of %d bytes\n", i, received[i], NMSGS);
+            exit(1);
+        }
+    }
+    printf("[*] Async I/O Test Complete.\n");
+    return 0;
+}
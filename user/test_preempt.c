@@ -0,0 +1,52 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+
+#include "user/ulthread.h"
+#include <stdarg.h>
+
+#define NTHREADS 3
+
+volatile int spins[NTHREADS];
+
+int all_started(void) {
+    for (int i=0; i<NTHREADS; i++)
+        if (spins[i] == 0)
+            return 0;
+    return 1;
+}
+
+/* Never yields: only preemption lets the other threads run */
+void ul_start_func(int idx) {
+    while (!all_started())
+        spins[idx]++;
+    ulthread_destroy();
+}
+
+int
+main(int argc, char *argv[])
+{
+    /* Initialize the user-level threading library */
+    ulthread_init(ROUNDROBIN);
+    ulthread_preempt(1);
+
+    printf("Testing preemption of CPU-bound threads:\n");
+
+    for (int i=0; i<NTHREADS; i++) {
+        uint64 args[6] = {i,0,0,0,0,0};
+        if (ulthread_spawn((uint64) ul_start_func, args, -1, ULTHREAD_STACKSIZE) < 0) {
+            printf("spawn failed at thread %d\n", i);
+            exit(1);
+        }
+    }
+    ulthread_schedule();
+
+    printf("[*] Preemption Test Complete.\n");
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+
+#include "user/ulthread.h"
+#include <stdarg.h>
+
+#define NSPAWN 2*MAXULTHREADS
+
+int finished = 0;
+
+void ul_start_func(int wave) {
+    /* Touch the stack to make sure it is usable */
+    char buf[512];
+    memset(buf, wave, sizeof(buf));
+    ulthread_yield();
+    if (buf[sizeof(buf)-1] == wave)
+        finished++;
+    ulthread_destroy();
+}
+
+void spawn_wave(int wave) {
+    uint64 args[6] = {wave,0,0,0,0,0};
+    for (int i=0; i<NSPAWN; i++) {
+        if (ulthread_spawn((uint64) ul_start_func, args, -1, ULTHREAD_STACKSIZE) < 0) {
+            printf("spawn failed at thread %d\n", i);
+            exit(1);
+        }
+    }
+    ulthread_schedule();
+}
+
+int
+main(int argc, char *argv[])
+{
+    /* Initialize the user-level threading library */
+    ulthread_init(ROUNDROBIN);
+
+    printf("Testing pooled thread stacks:\n");
+
+    /* More threads than MAXULTHREADS, each on its own pooled stack */
+    spawn_wave(1);
+    char *brk = sbrk(0);
+
+    /* A second wave must be served entirely from recycled stacks */
+    spawn_wave(2);
+    if (sbrk(0) != brk) {
+        printf("stacks were not recycled\n");
+        exit(1);
+    }
+
+    if (finished != 2*NSPAWN) {
+        printf("only %d of %d threads finished\n", finished, 2*NSPAWN);
+        exit(1);
+    }
+
+    printf("[*] Pooled Stack Test Complete.\n");
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+
+#include "user/ulthread.h"
+#include <stdarg.h>
+
+#define NWORKERS 4
+#define NINCR 20
+#define NITEMS 50
+
+struct ulthread_mutex mu;
+struct ulthread_cond cv;
+struct ulthread_sem done;
+struct ulthread_chan ch;
+
+int counter = 0, inside = 0, overlap = 0;
+int arrived = 0;
+int sum = 0;
+
+/* Increment counter with a yield inside the critical section */
+void incr_func(void) {
+    for (int i = 0; i < NINCR; i++) {
+        ulthread_mutex_lock(&mu);
+        if (inside++)
+            overlap = 1;
+        int c = counter;
+        ulthread_yield();
+        counter = c + 1;
+        inside--;
+        ulthread_mutex_unlock(&mu);
+    }
+
+    /* Barrier: wait until every incrementer is done */
+    ulthread_mutex_lock(&mu);
+    if (++arrived == NWORKERS)
+        ulthread_cond_broadcast(&cv);
+    while (arrived < NWORKERS)
+        ulthread_cond_wait(&cv, &mu);
+    ulthread_mutex_unlock(&mu);
+
+    ulthread_sem_post(&done);
+    ulthread_destroy();
+}
+
+void producer_func(void) {
+    for (int i = 1; i <= NITEMS; i++)
+        ulthread_chan_send(&ch, i);
+    ulthread_destroy();
+}
+
+void consumer_func(void) {
+    for (int i = 1; i <= NITEMS; i++)
+        sum += ulthread_chan_recv(&ch);
+    ulthread_sem_post(&done);
+    ulthread_destroy();
+}
+
+/* Waits for everyone else to finish */
+void waiter_func(void) {
+    for (int i = 0; i < NWORKERS + 1; i++)
+        ulthread_sem_wait(&done);
+    if (counter != NWORKERS*NINCR || overlap) {
+        printf("mutex failed: counter %d, overlap %d\n", counter, overlap);
+        exit(1);
+    }
+    if (sum != NITEMS*(NITEMS+1)/2) {
+        printf("channel failed: sum %d\n", sum);
+        exit(1);
+    }
+    printf("[*] Synchronization Test Complete.\n");
+    ulthread_destroy();
+}
+
+int
+main(int argc, char *argv[])
+{
+    /* Initialize the user-level threading library */
+    ulthread_init(ROUNDROBIN);
+
+    ulthread_mutex_init(&mu);
+    ulthread_cond_init(&cv);
+    ulthread_sem_init(&done, 0);
+    if (!ulthread_chan_init(&ch, 2)) {
+        printf("out of memory\n");
+        exit(1);
+    }
+
+    printf("Testing blocking synchronization:\n");
+
+    uint64 args[6] = {0,0,0,0,0,0};
+    ulthread_spawn((uint64) waiter_func, args, -1, ULTHREAD_STACKSIZE);
+    for (int i = 0; i < NWORKERS; i++)
+        ulthread_spawn((uint64) incr_func, args, -1, ULTHREAD_STACKSIZE);
+    ulthread_spawn((uint64) consumer_func, args, -1, ULTHREAD_STACKSIZE);
+    ulthread_spawn((uint64) producer_func, args, -1, ULTHREAD_STACKSIZE);
+    ulthread_schedule();
+
+    ulthread_chan_free(&ch);
+    return 0;
+}
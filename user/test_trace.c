@@ -0,0 +1,70 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+
+#include "user/ulthread.h"
+#include <stdarg.h>
+
+#define NTHREADS 3
+#define NYIELD 4
+
+void ul_start_func(void) {
+    for (int i = 0; i < NYIELD; i++)
+        ulthread_yield();
+    ulthread_destroy();
+}
+
+int
+main(int argc, char *argv[])
+{
+    /* Initialize the user-level threading library */
+    ulthread_init(ROUNDROBIN);
+    ulthread_trace(TRACE_RING);
+
+    printf("Testing the binary trace ring:\n");
+
+    uint64 args[6] = {0,0,0,0,0,0};
+    for (int i = 0; i < NTHREADS; i++)
+        ulthread_spawn((uint64) ul_start_func, args, -1, ULTHREAD_STACKSIZE);
+    ulthread_schedule();
+
+    int fd = open("ultrace.out", O_CREATE | O_TRUNC | O_RDWR);
+    if (fd < 0 || ulthread_trace_dump(fd) < 0) {
+        printf("dump failed\n");
+        exit(1);
+    }
+    close(fd);
+
+    /* Read the dump back and count events */
+    struct ulthread_trace_hdr hdr;
+    struct ulthread_trace_rec r;
+    int count[ULTRACE_EXIT+1] = {0};
+    fd = open("ultrace.out", O_RDONLY);
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != ULTRACE_MAGIC) {
+        printf("bad trace header\n");
+        exit(1);
+    }
+    for (int i = 0; i < hdr.nrec; i++) {
+        if (read(fd, &r, sizeof(r)) != sizeof(r) || r.event < 0 || r.event > ULTRACE_EXIT) {
+            printf("bad trace record %d\n", i);
+            exit(1);
+        }
+        count[r.event]++;
+    }
+    close(fd);
+
+    if (count[ULTRACE_CREATE] != NTHREADS || count[ULTRACE_YIELD] != NTHREADS*NYIELD ||
+        count[ULTRACE_DESTROY] != NTHREADS || count[ULTRACE_EXIT] != 1) {
+        printf("unexpected event counts\n");
+        exit(1);
+    }
+
+    printf("[*] Trace Ring Test Complete. Decode ultrace.out with ultrace.\n");
+    return 0;
+}
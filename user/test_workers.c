@@ -0,0 +1,73 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+
+#include "user/ulthread.h"
+#include <stdarg.h>
+
+#define NWORKERS 3
+#define NTHREADS 12
+#define NROUNDS  20
+
+int finished = 0;
+int pids[NTHREADS];
+
+void ul_start_func(int idx) {
+    volatile int sum = 0;
+    for (int r = 0; r < NROUNDS; r++) {
+        for (int i = 0; i < 100000; i++)
+            sum += i;
+        ulthread_yield();
+    }
+    /* The kernel thread that ran this user thread last */
+    pids[idx] = getpid();
+    __sync_fetch_and_add(&finished, 1);
+    ulthread_destroy();
+}
+
+int
+main(int argc, char *argv[])
+{
+    /* Initialize the user-level threading library with several workers */
+    ulthread_init_mn(ROUNDROBIN, NWORKERS);
+
+    printf("Testing user threads on %d kernel workers:\n", NWORKERS);
+
+    for (int i=0; i<NTHREADS; i++) {
+        uint64 args[6] = {i,0,0,0,0,0};
+        if (ulthread_spawn((uint64) ul_start_func, args, -1, ULTHREAD_STACKSIZE) < 0) {
+            printf("spawn failed at thread %d\n", i);
+            exit(1);
+        }
+    }
+    ulthread_schedule();
+
+    if (finished != NTHREADS) {
+        printf("only %d of %d threads finished\n", finished, NTHREADS);
+        exit(1);
+    }
+
+    int nkthreads = 0;
+    for (int i=0; i<NTHREADS; i++) {
+        int seen = 0;
+        for (int j=0; j<i; j++)
+            if (pids[j] == pids[i])
+                seen = 1;
+        if (!seen)
+            nkthreads++;
+    }
+    printf("threads finished on %d kernel thread(s)\n", nkthreads);
+    if (NWORKERS > 1 && nkthreads < 2) {
+        printf("all threads ran on one of %d workers\n", NWORKERS);
+        exit(1);
+    }
+
+    printf("[*] Worker Test Complete.\n");
+    return 0;
+}
@@ -15,7 +15,7 @@
 char stacks[PGSIZE*MAXULTHREADS];
 
 void ul_start_func(void) {
-    int start_time = ctime();
+    uint64 start_time = ctime();
     int scheduled_rounds = 0;
     for(;;) {
         if((ctime() - start_time) > 10000) {
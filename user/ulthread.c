@@ -2,6 +2,8 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/poll.h"
+#include "kernel/param.h"
 #include "kernel/types.h"
 #include "kernel/riscv.h"
 #include "user/user.h"
@@ -9,160 +11,1008 @@
 
 /* Standard definitions */
 #include <stdbool.h>
-#include <stddef.h> 
+#include <stddef.h>
 
 extern void ulthread_schedule(void);
 static struct ulthread_list t_list;
 
+/* Trace ring, shared by all workers */
+static struct {
+    enum ulthread_trace_mode mode;
+    uint64 next;                  // records ever written
+    struct ulthread_trace_rec rec[ULTRACE_NREC];
+} trace = { .mode = TRACE_PRINTF };
+
+/* Each worker keeps a pointer to its ulworker in tp, which the
+ * kernel saves and restores with the rest of the user registers
+ * and which ulthread_context_switch() leaves alone. Threads can
+ * migrate between workers, so never cache the result across a
+ * context switch. */
+static struct ulworker *myworker(void) {
+    return (struct ulworker *)r_tp();
+}
+
+/* Preemption is deferred while the worker's preempt_off count is
+ * non-zero. The count is updated with a single tp-relative atomic,
+ * so an upcall can't move the thread to another worker between
+ * finding the worker and updating its count. Threads are always
+ * switched in and out with the count raised, so the scheduler loop
+ * itself is never preempted. */
+static void preempt_off(void) {
+    asm volatile("amoadd.w zero, %0, (tp)" : : "r" (1) : "memory");
+}
+
+static void preempt_on(void) {
+    asm volatile("amoadd.w zero, %0, (tp)" : : "r" (-1) : "memory");
+    struct ulworker *w = myworker();
+    if (w->preempt_off == 0 && w->preempt_pending && w->current) {
+        w->preempt_pending = 0;
+        ulthread_yield();
+    }
+}
+
+/* With preemption on, threads must bracket calls that take locks
+ * outside this library, such as malloc(), with these. */
+void ulthread_preempt_disable(void) {
+    preempt_off();
+}
+
+void ulthread_preempt_enable(void) {
+    preempt_on();
+}
+
+/* Record a scheduling event. printf() costs a write() per character,
+ * so TRACE_RING only stores a fixed-size record. */
+static void trace_event(enum ulthread_trace_event event, int tid,
+                        uint64 arg0, uint64 arg1) {
+    if (trace.mode == TRACE_RING) {
+        uint64 i = __sync_fetch_and_add(&trace.next, 1);
+        struct ulthread_trace_rec *r = &trace.rec[i % ULTRACE_NREC];
+        r->time = ctime();
+        r->arg0 = arg0;
+        r->arg1 = arg1;
+        r->tid = tid;
+        r->event = event;
+        return;
+    }
+    if (trace.mode != TRACE_PRINTF)
+        return;
+    switch (event) {
+    case ULTRACE_CREATE:
+        printf("[*] ultcreate(tid: %d, ra: %p, sp: %p)\n", tid, arg0, arg1);
+        break;
+    case ULTRACE_SCHEDULE:
+        printf("[*] ultschedule (next tid: %d)\n", tid);
+        break;
+    case ULTRACE_YIELD:
+        printf("[*] ultyield(tid: %d)\n", tid);
+        break;
+    case ULTRACE_DESTROY:
+        printf("[*] ultdestroy(tid: %d)\n", tid);
+        break;
+    case ULTRACE_BLOCK:
+        printf("[*] ultblock(tid: %d)\n", tid);
+        break;
+    case ULTRACE_EXIT:
+        printf("No thread to schedule. Exiting...\n");
+        break;
+    }
+}
+
+/* Choose where scheduling events go from now on. */
+void ulthread_trace(enum ulthread_trace_mode mode) {
+    trace.mode = mode;
+}
+
+/* Write the records in the trace ring to fd, oldest first, after a
+ * ulthread_trace_hdr. Returns the number of records, or -1. */
+int ulthread_trace_dump(int fd) {
+    struct ulthread_trace_hdr hdr;
+    uint64 end = trace.next;
+    uint64 n = end < ULTRACE_NREC ? end : ULTRACE_NREC;
+
+    hdr.magic = ULTRACE_MAGIC;
+    hdr.nrec = n;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        return -1;
+    for (uint64 i = end - n; i < end; i++) {
+        struct ulthread_trace_rec *r = &trace.rec[i % ULTRACE_NREC];
+        if (write(fd, r, sizeof(*r)) != sizeof(*r))
+            return -1;
+    }
+    return n;
+}
+
+/* Locks shared between workers. Holders can't be preempted, or
+ * another thread on the same worker could spin on the lock forever. */
+static void lock_acquire(struct ulthread_lock *lk) {
+    preempt_off();
+    while (__sync_lock_test_and_set(&lk->locked, 1) != 0)
+        ;
+    __sync_synchronize();
+}
+
+/* Release lk but leave preemption off, for a thread that is
+ * switching away with the count raised. */
+static void lock_drop(struct ulthread_lock *lk) {
+    __sync_synchronize();
+    __sync_lock_release(&lk->locked);
+}
+
+static void lock_release(struct ulthread_lock *lk) {
+    lock_drop(lk);
+    preempt_on();
+}
+
+/* Timer upcall from the kernel: switch to the next thread, or note
+ * that a switch is due if the running thread can't be preempted.
+ * frame holds the interrupted registers. It is resumed on whichever
+ * worker runs this thread next. */
+static void preempt_upcall(uint64 frame) {
+    struct ulworker *w = myworker();
+    if (w->preempt_off || w->current == NULL)
+        w->preempt_pending = 1;
+    else
+        ulthread_yield();
+    sigreturn(frame);
+}
+
 /* Get thread ID */
 int get_current_tid(void) {
-    return t_list.current;
+    struct ulthread *t = myworker()->current;
+    return t ? t->tid : 0;
+}
+
+/* Run queue helpers */
+static void queue_push_back(struct ulthread_queue *q, struct ulthread *t) {
+    t->next = NULL;
+    t->prev = q->tail;
+    if (q->tail)
+        q->tail->next = t;
+    else
+        q->head = t;
+    q->tail = t;
+}
+
+static void queue_push_front(struct ulthread_queue *q, struct ulthread *t) {
+    t->prev = NULL;
+    t->next = q->head;
+    if (q->head)
+        q->head->prev = t;
+    else
+        q->tail = t;
+    q->head = t;
 }
 
-int find_available_tid(void) {
-    for (int i=1; i<MAXULTHREADS; i++) {
-        if(t_list.threads[i].state == FREE)
-            return i;
+static struct ulthread *queue_pop(struct ulthread_queue *q) {
+    struct ulthread *t = q->head;
+    if (t) {
+        q->head = t->next;
+        if (q->head)
+            q->head->prev = NULL;
+        else
+            q->tail = NULL;
+        t->next = NULL;
     }
-    return -1;
+    return t;
 }
 
-int round_robin_select(void) {
-    int i = t_list.current+1;
-    int ct = 0;
-    while (ct < MAXULTHREADS) {
-        if (i!=0 && t_list.threads[i].state == RUNNABLE)
-            return i;
-        i = (i+1) % MAXULTHREADS;
-        ct++;
+static struct ulthread *queue_pop_back(struct ulthread_queue *q) {
+    struct ulthread *t = q->tail;
+    if (t) {
+        q->tail = t->prev;
+        if (q->tail)
+            q->tail->next = NULL;
+        else
+            q->head = NULL;
+        t->prev = NULL;
     }
-    return 0;
+    return t;
+}
+
+static void queue_remove(struct ulthread_queue *q, struct ulthread *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        q->head = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    else
+        q->tail = t->prev;
+    t->next = t->prev = NULL;
 }
 
-int priority_select(void) {
-    int hp_idx = 0;
-    int hp_val = -1;
-    for (int i=1; i<MAXULTHREADS; i++) {
-        if (t_list.threads[i].state == RUNNABLE) {
-            if (t_list.threads[i].priority > hp_val) {
-                hp_idx = i;
-                hp_val = t_list.threads[i].priority;
+/* Index of the most significant set bit of a non-zero word */
+static int highest_bit(uint64 x) {
+    int n = 0;
+    if (x >> 32) { x >>= 32; n += 32; }
+    if (x >> 16) { x >>= 16; n += 16; }
+    if (x >> 8)  { x >>= 8;  n += 8; }
+    if (x >> 4)  { x >>= 4;  n += 4; }
+    if (x >> 2)  { x >>= 2;  n += 2; }
+    if (x >> 1)  { n += 1; }
+    return n;
+}
+
+/* Index of the least significant set bit of a non-zero word */
+static int lowest_bit(uint64 x) {
+    int n = 0;
+    if ((x & 0xffffffffUL) == 0) { x >>= 32; n += 32; }
+    if ((x & 0xffff) == 0) { x >>= 16; n += 16; }
+    if ((x & 0xff) == 0)   { x >>= 8;  n += 8; }
+    if ((x & 0xf) == 0)    { x >>= 4;  n += 4; }
+    if ((x & 0x3) == 0)    { x >>= 2;  n += 2; }
+    if ((x & 0x1) == 0)    { n += 1; }
+    return n;
+}
+
+static int prio_bucket(int priority) {
+    if (priority < 0)
+        return 0;
+    if (priority >= ULTHREAD_NPRIO)
+        return ULTHREAD_NPRIO-1;
+    return priority;
+}
+
+/* Whether any worker has a thread ready to run. */
+static bool work_queued(void) {
+    for (int i = 0; i < t_list.nworkers; i++)
+        if (t_list.workers[i].nready)
+            return true;
+    return false;
+}
+
+/* Wake one worker blocked in worker_idle(), if any. Only one byte
+ * is ever in the pipe, so this never blocks; the worker it wakes
+ * passes the wakeup on while there is more to do. */
+static void wake_idle(void) {
+    __sync_synchronize();
+    if (t_list.nidle > 0 && __sync_bool_compare_and_swap(&t_list.kicked, 0, 1))
+        write(t_list.wake_fd[1], "", 1);
+}
+
+/* The runq_* helpers must be called with w->lock held. */
+
+/* Add a newly runnable thread behind everything already queued. */
+static void runq_push(struct ulworker *w, struct ulthread *t) {
+    struct ulthread_runq *rq = &w->runq;
+    if (t_list.algorithm == PRIORITY) {
+        int b = prio_bucket(t->priority);
+        queue_push_back(&rq->prio[b], t);
+        rq->prio_map |= (1UL << b);
+    } else {
+        queue_push_back(&rq->fifo, t);
+    }
+    w->nready++;
+    wake_idle();
+}
+
+/* Put a thread that has just yielded back into the run queue.
+ * FCFS keeps the queue in creation order: the yielder was the
+ * oldest runnable thread when it was picked, so it goes first. */
+static void runq_requeue(struct ulworker *w, struct ulthread *t) {
+    if (t_list.algorithm == FCFS) {
+        queue_push_front(&w->runq.fifo, t);
+        w->nready++;
+        wake_idle();
+    } else {
+        runq_push(w, t);
+    }
+}
+
+/* Remove and return the next thread to run, or NULL if none.
+ * The owning worker takes from the front of its deque and thieves
+ * take from the back. */
+static struct ulthread *runq_take(struct ulworker *w, bool steal) {
+    struct ulthread_runq *rq = &w->runq;
+    struct ulthread *t;
+    if (t_list.algorithm == PRIORITY) {
+        if (rq->prio_map == 0)
+            return NULL;
+        int b = highest_bit(rq->prio_map);
+        t = steal ? queue_pop_back(&rq->prio[b]) : queue_pop(&rq->prio[b]);
+        if (rq->prio[b].head == NULL)
+            rq->prio_map &= ~(1UL << b);
+    } else {
+        t = steal ? queue_pop_back(&rq->fifo) : queue_pop(&rq->fifo);
+    }
+    if (t)
+        w->nready--;
+    return t;
+}
+
+/* Take a thread from the back of another worker's deque. */
+static struct ulthread *steal_thread(struct ulworker *w) {
+    for (int i = 1; i < t_list.nworkers; i++) {
+        struct ulworker *victim = &t_list.workers[(w->id + i) % t_list.nworkers];
+        if (victim->nready == 0)
+            continue;
+        lock_acquire(&victim->lock);
+        struct ulthread *t = runq_take(victim, true);
+        lock_release(&victim->lock);
+        if (t)
+            return t;
+    }
+    return NULL;
+}
+
+/* Thread table: grows by doubling, TCBs are allocated on first use
+ * of a tid and recycled afterwards. Called with t_list.lock held. */
+static bool grow_table(void) {
+    int ncap = t_list.capacity ? 2*t_list.capacity : 2*MAXULTHREADS;
+    ncap = (ncap + 63) & ~63;
+
+    struct ulthread **threads = malloc(ncap * sizeof(struct ulthread *));
+    uint64 *tid_map = malloc(ncap / 64 * sizeof(uint64));
+    if (threads == NULL || tid_map == NULL) {
+        if (threads)
+            free(threads);
+        if (tid_map)
+            free(tid_map);
+        return false;
+    }
+    memset(threads, 0, ncap * sizeof(struct ulthread *));
+    memset(tid_map, 0, ncap / 64 * sizeof(uint64));
+    if (t_list.capacity) {
+        memmove(threads, t_list.threads, t_list.capacity * sizeof(struct ulthread *));
+        memmove(tid_map, t_list.tid_map, t_list.capacity / 64 * sizeof(uint64));
+        free(t_list.threads);
+        free(t_list.tid_map);
+    }
+    t_list.threads = threads;
+    t_list.tid_map = tid_map;
+    t_list.capacity = ncap;
+    return true;
+}
+
+/* Claim the lowest free tid below limit, allocating its TCB if needed.
+ * Called with t_list.lock held. */
+static struct ulthread *alloc_thread(int limit) {
+    int tid = -1;
+    for (;;) {
+        for (int w = 0; w < t_list.capacity / 64; w++) {
+            if (~t_list.tid_map[w] != 0) {
+                tid = w*64 + lowest_bit(~t_list.tid_map[w]);
+                break;
             }
         }
+        if (tid != -1 || t_list.capacity >= limit || !grow_table())
+            break;
+    }
+    if (tid == -1 || tid >= limit)
+        return NULL;
+
+    struct ulthread *thread = t_list.threads[tid];
+    if (thread == NULL) {
+        if ((thread = malloc(sizeof(struct ulthread))) == NULL)
+            return NULL;
+        memset(thread, 0, sizeof(struct ulthread));
+        t_list.threads[tid] = thread;
     }
-    return hp_idx;
+    t_list.tid_map[tid/64] |= (1UL << (tid%64));
+    thread->tid = tid;
+    return thread;
 }
 
-int fcfs_select(void) {
-    int fc_idx = 0;
-    int fc_val = ctime();
-    for (int i=1; i<MAXULTHREADS; i++) {
-        if (t_list.threads[i].state == RUNNABLE) {
-            if (t_list.threads[i].created_at < fc_val) {
-                fc_idx = i;
-                fc_val = t_list.threads[i].created_at;
-            }
+static void free_tid(int tid) {
+    t_list.tid_map[tid/64] &= ~(1UL << (tid%64));
+}
+
+/* Stack pool: stacks come from sbrk() with a guard page below them
+ * and are recycled by page count once their thread is destroyed.
+ * Called with t_list.lock held. */
+static uint64 stack_alloc(uint64 npages) {
+    int b = npages <= ULSTACK_NBUCKET ? npages : 0;
+    struct ulstack **sp = &t_list.free_stacks[b];
+    for (; *sp; sp = &(*sp)->next) {
+        if ((*sp)->npages == npages) {
+            struct ulstack *s = *sp;
+            *sp = s->next;
+            return (uint64)s + npages*PGSIZE;
         }
     }
-    return fc_idx;
+
+    char *base = sbrk((npages+1)*PGSIZE);
+    if (base == (char *)-1)
+        return 0;
+    if (guardpage(base) < 0)
+        return 0;
+    return (uint64)base + (npages+1)*PGSIZE;
+}
+
+static void stack_free(uint64 top, uint64 npages) {
+    struct ulstack *s = (struct ulstack *)(top - npages*PGSIZE);
+    int b = npages <= ULSTACK_NBUCKET ? npages : 0;
+    s->npages = npages;
+    s->next = t_list.free_stacks[b];
+    t_list.free_stacks[b] = s;
 }
 
-int select_thread(void) {
-    switch(t_list.algorithm) {
-        case ROUNDROBIN:
-            return round_robin_select();
-        case PRIORITY:
-            return priority_select();
-        default:
-            return fcfs_select();
+/* Release a destroyed thread once no worker is running on its stack. */
+static void reap_thread(struct ulthread *t) {
+    lock_acquire(&t_list.lock);
+    if (t->stack_pages) {
+        stack_free((uint64)t->stack, t->stack_pages);
+        t->stack_pages = 0;
+    }
+    free_tid(t->tid);
+    t_list.total--;
+    lock_release(&t_list.lock);
+    /* Idle workers have to see this to return */
+    if (t_list.total == 1)
+        wake_idle();
+}
+
+static void worker_schedule(struct ulworker *w);
+static void finish_switch(struct ulworker *w);
+
+/* Entry point of the kernel threads backing workers 1..n-1 */
+static void worker_main(void *arg) {
+    struct ulworker *w = arg;
+    w_tp((uint64)w);
+    worker_schedule(w);
+    exit(0);
+}
+
+/* Start a kernel thread, sharing this address space, for worker w. */
+static int start_worker(struct ulworker *w) {
+    lock_acquire(&t_list.lock);
+    w->stack = stack_alloc(ULWORKER_STACKPAGES);
+    lock_release(&t_list.lock);
+    if (w->stack == 0)
+        return -1;
+    if ((w->pid = clone(worker_main, (void *)w->stack, w)) < 0) {
+        lock_acquire(&t_list.lock);
+        stack_free(w->stack, ULWORKER_STACKPAGES);
+        lock_release(&t_list.lock);
+        w->stack = 0;
+        return -1;
     }
     return 0;
 }
 
-/* Thread initialization */
-void ulthread_init(int schedalgo) {
-    struct ulthread *s_thread = &t_list.threads[0];
-    s_thread->tid = 0;
-    s_thread->state = RUNNABLE;
-    s_thread->stack = malloc(PGSIZE);
-    s_thread->start_func = (uint64)ulthread_schedule;
-    memset(&s_thread->context, 0, sizeof(s_thread->context));
-    s_thread->context.sp = s_thread->stack + PGSIZE;
-    s_thread->context.ra = (uint64)ulthread_schedule;
+/* Wait for the kernel thread of worker w to exit. */
+static void stop_worker(struct ulworker *w) {
+    if (w->stack == 0)
+        return;
+    join();
+    lock_acquire(&t_list.lock);
+    stack_free(w->stack, ULWORKER_STACKPAGES);
+    lock_release(&t_list.lock);
+    w->stack = 0;
+}
+
+/* Thread initialization for an M:N runtime with nworkers workers */
+void ulthread_init_mn(int schedalgo, int nworkers) {
+    if (nworkers < 1)
+        nworkers = 1;
+    if (nworkers > ULTHREAD_MAXWORKERS)
+        nworkers = ULTHREAD_MAXWORKERS;
+
+    for (int i = 0; i < ULTHREAD_MAXWORKERS; i++) {
+        struct ulworker *w = &t_list.workers[i];
+        memset(w, 0, sizeof(*w));
+        w->id = i;
+    }
+    /* The calling process is worker 0 */
+    w_tp((uint64)&t_list.workers[0]);
+
+    lock_acquire(&t_list.lock);
+    if (t_list.capacity == 0 && !grow_table()) {
+        printf("ulthread_init: out of memory\n");
+        exit(1);
+    }
+    /* tid 0 stands for the scheduler */
+    t_list.tid_map[0] |= 1;
     t_list.total = 1;
-    t_list.current = 0;
     t_list.algorithm = schedalgo;
-}
+    t_list.nworkers = nworkers;
+    t_list.preempt_ticks = 0;
+    t_list.nidle = 0;
+    t_list.kicked = 0;
+    lock_release(&t_list.lock);
 
-/* Thread creation */
-bool ulthread_create(uint64 start, uint64 stack, uint64 args[], int priority) {
-    int tid = find_available_tid();
-    if (tid == -1) {
-        printf("All threads occupied :(\n");
-        return false;
+    /* Idle workers block reading this until there is work */
+    if (nworkers > 1 && t_list.wake_fd[1] == 0 && pipe(t_list.wake_fd) < 0) {
+        printf("ulthread_init: out of file descriptors\n");
+        exit(1);
     }
-    printf("[*] ultcreate(tid: %d, ra: %p, sp: %p)\n", tid, start, stack);
-    struct ulthread *thread = &t_list.threads[tid];
-    thread->tid = tid;
+}
+
+/* Preempt threads after ticks timer ticks of running, or never if
+ * ticks is 0 (the default). Takes effect at ulthread_schedule(). */
+void ulthread_preempt(int ticks) {
+    t_list.preempt_ticks = ticks > 0 ? ticks : 0;
+}
+
+/* Thread initialization */
+void ulthread_init(int schedalgo) {
+    ulthread_init_mn(schedalgo, 1);
+}
+
+/* First code run by every thread, called by ulthread_start with the
+ * thread's arguments. Threads are switched to with preemption off,
+ * so turn it on before calling the start function. */
+static void thread_start(uint64 a0, uint64 a1, uint64 a2,
+                         uint64 a3, uint64 a4, uint64 a5) {
+    struct ulworker *w = myworker();
+    struct ulthread *t = w->current;
+    finish_switch(w);
+    preempt_on();
+    ((void (*)(uint64, uint64, uint64, uint64, uint64, uint64))t->start_func)(a0, a1, a2, a3, a4, a5);
+    ulthread_destroy();
+}
+
+static void thread_setup(struct ulthread *thread, uint64 start, uint64 stack,
+                         uint64 args[], int priority) {
+    trace_event(ULTRACE_CREATE, thread->tid, start, stack);
     thread->state = RUNNABLE;
-    thread->stack = stack;
-    thread->start_func = start;
+    thread->stack = (uint64 *)stack;
+    thread->start_func = (uint64 *)start;
     thread->priority = priority;
     thread->created_at = ctime();
     memset(&thread->context, 0, sizeof(thread->context));
     thread->context.sp = stack;
-    thread->context.ra = start;
+    thread->context.ra = (uint64)ulthread_start;
+    thread->context.s1 = (uint64)&thread->context;
+    thread->context.s2 = (uint64)thread_start;
     thread->context.a0 = args[0];
     thread->context.a1 = args[1];
     thread->context.a2 = args[2];
     thread->context.a3 = args[3];
     thread->context.a4 = args[4];
     thread->context.a5 = args[5];
+
+    /* New threads start on the creating worker */
+    struct ulworker *w = myworker();
+    lock_acquire(&w->lock);
+    runq_push(w, thread);
+    lock_release(&w->lock);
+}
+
+/* Thread creation on a caller-provided stack */
+bool ulthread_create(uint64 start, uint64 stack, uint64 args[], int priority) {
+    lock_acquire(&t_list.lock);
+    struct ulthread *thread = alloc_thread(MAXULTHREADS);
+    if (thread == NULL) {
+        lock_release(&t_list.lock);
+        printf("All threads occupied :(\n");
+        return false;
+    }
+    thread->stack_pages = 0;
     t_list.total++;
+    lock_release(&t_list.lock);
+
+    thread_setup(thread, start, stack, args, priority);
     return true;
 }
 
-/* Thread scheduler */
-void ulthread_schedule(void) {
-    struct ulthread *s_thread = &t_list.threads[0];
+/* Thread creation on a pooled stack of at least stacksize bytes.
+ * Returns the new tid, or -1 if out of memory. */
+int ulthread_spawn(uint64 start, uint64 args[], int priority, uint64 stacksize) {
+    uint64 npages = stacksize ? (stacksize + PGSIZE - 1) / PGSIZE : 1;
+
+    lock_acquire(&t_list.lock);
+    uint64 stack = stack_alloc(npages);
+    if (stack == 0) {
+        lock_release(&t_list.lock);
+        return -1;
+    }
+    struct ulthread *thread = alloc_thread(__INT_MAX__);
+    if (thread == NULL) {
+        stack_free(stack, npages);
+        lock_release(&t_list.lock);
+        return -1;
+    }
+    thread->stack_pages = npages;
+    t_list.total++;
+    lock_release(&t_list.lock);
+
+    thread_setup(thread, start, stack, args, priority);
+    return thread->tid;
+}
+
+/* Check the fds that parked threads wait for and make the threads
+ * whose fd is ready runnable on worker w. If block is set, wait in
+ * the kernel until at least one fd is ready. */
+static void poll_io(struct ulworker *w, bool block) {
+    struct pollfd fds[NOFILE];
+    struct ulthread *t, *next;
+    int nfds = 0, i;
+
+    lock_acquire(&t_list.io_lock);
+    for (t = t_list.io_waiters.head; t; t = t->next) {
+        for (i = 0; i < nfds && fds[i].fd != t->wait_fd; i++)
+            ;
+        if (i == nfds) {
+            if (nfds == NOFILE)
+                continue;
+            fds[nfds].fd = t->wait_fd;
+            fds[nfds].events = 0;
+            nfds++;
+        }
+        fds[i].events |= t->wait_events;
+    }
+    lock_release(&t_list.io_lock);
+    if (nfds == 0 || poll(fds, nfds, block) <= 0)
+        return;
+
+    lock_acquire(&t_list.io_lock);
+    for (t = t_list.io_waiters.head; t; t = next) {
+        next = t->next;
+        for (i = 0; i < nfds && fds[i].fd != t->wait_fd; i++)
+            ;
+        if (i == nfds || (fds[i].revents & (t->wait_events | POLLHUP | POLLNVAL)) == 0)
+            continue;
+        queue_remove(&t_list.io_waiters, t);
+        t_list.nio--;
+        t->state = RUNNABLE;
+        lock_acquire(&w->lock);
+        runq_push(w, t);
+        lock_release(&w->lock);
+    }
+    lock_release(&t_list.io_lock);
+}
+
+/* Next thread for worker w to run, or NULL if none is runnable. */
+static struct ulthread *pick_next(struct ulworker *w) {
+    /* Don't let busy threads starve those waiting for I/O. Not
+     * while a thread parking itself in wait_fd() still holds
+     * io_lock, which poll_io() takes. */
+    if (t_list.nio && ++w->npicks % ULTHREAD_IOPOLL == 0 &&
+        w->unlock != &t_list.io_lock)
+        poll_io(w, false);
+
+    lock_acquire(&w->lock);
+    struct ulthread *t = runq_take(w, false);
+    lock_release(&w->lock);
+    if (t == NULL && t_list.nworkers > 1)
+        t = steal_thread(w);
+    return t;
+}
+
+/* Save the running context in from and switch worker w to next. */
+static void switch_to(struct ulworker *w, struct ulthread_context *from,
+                      struct ulthread *next) {
+    next->state = RUNNABLE;
+
+    trace_event(ULTRACE_SCHEDULE, next->tid, 0, 0);
+    w->current = next;
+    w->preempt_pending = 0;
+    ulthread_context_switch(from, &next->context);
+}
+
+/* Switch worker w from c_thread, which won't be requeued, to the
+ * next runnable thread, or to the scheduler loop if there is none. */
+static void switch_away(struct ulworker *w, struct ulthread *c_thread) {
+    struct ulthread *next = pick_next(w);
+    if (next) {
+        switch_to(w, &c_thread->context, next);
+    } else {
+        w->current = NULL;
+        ulthread_context_switch(&c_thread->context, &w->context);
+    }
+}
+
+/* Run on worker w right after every switch, once the thread that
+ * switched away is no longer on its stack: make a yielder runnable
+ * for subsequent schedules, let a blocked thread be woken and
+ * release a destroyed thread. */
+static void finish_switch(struct ulworker *w) {
+    if (w->yielded) {
+        struct ulthread *y_thread = w->yielded;
+        w->yielded = NULL;
+        y_thread->state = RUNNABLE;
+        lock_acquire(&w->lock);
+        runq_requeue(w, y_thread);
+        lock_release(&w->lock);
+    }
+    if (w->unlock) {
+        lock_drop(w->unlock);
+        w->unlock = NULL;
+    }
+    if (w->exited) {
+        reap_thread(w->exited);
+        w->exited = NULL;
+    }
+}
+
+/* Block this worker, which has found nothing to run for a while,
+ * until wake_idle(). It counts itself idle before looking once
+ * more, so a thread made runnable in between isn't missed. */
+static void worker_idle(void) {
+    char c;
+
+    __sync_fetch_and_add(&t_list.nidle, 1);
+    if (work_queued() || t_list.total == 1) {
+        __sync_fetch_and_sub(&t_list.nidle, 1);
+        return;
+    }
+    read(t_list.wake_fd[0], &c, 1);
+    __sync_fetch_and_sub(&t_list.nidle, 1);
+    __sync_fetch_and_and(&t_list.kicked, 0);
+
+    /* Pass the wakeup on while there is more to do */
+    if (work_queued() || t_list.total == 1)
+        wake_idle();
+}
+
+/* Per-worker scheduler loop. Threads hand the worker directly to
+ * each other, so this only runs when a destroyed thread finds
+ * nothing else to run. Returns once there is nothing left to run:
+ * with a single worker, when no thread is runnable; with several,
+ * when every thread has been destroyed. */
+static void worker_schedule(struct ulworker *w) {
+    int spins = 0;
+
+    preempt_off();
+    if (t_list.preempt_ticks)
+        sigalarm(t_list.preempt_ticks, preempt_upcall);
     for (;;) {
-        int tid = select_thread();
-        if (tid == 0) {
-            if (t_list.threads[t_list.yield_tid].state == YIELD) {
-                tid = t_list.yield_tid;
+        struct ulthread *r_thread = pick_next(w);
+        if (r_thread == NULL) {
+            if (t_list.nio) {
+                /* Everything left here is waiting for I/O */
+                poll_io(w, true);
+                continue;
             }
-            else {
-                printf("No thread to schedule. Exiting...\n");
-                return;
+            if (t_list.nworkers == 1 || t_list.total == 1) {
+                if (w->id == 0)
+                    trace_event(ULTRACE_EXIT, 0, 0, 0);
+                break;
             }
+            /* Work often turns up soon, so spin a little first */
+            if (++spins >= ULWORKER_IDLESPIN) {
+                spins = 0;
+                worker_idle();
+            }
+            continue;
         }
-        /* Make yielding thread runnable for subsequent schedules */
-        if (t_list.threads[t_list.yield_tid].state == YIELD) {
-            t_list.threads[t_list.yield_tid].state = RUNNABLE;
-        }
-        /* Add this statement to denote which thread-id is being scheduled next */
-        printf("[*] ultschedule (next tid: %d)\n", tid);
-        struct ulthread *r_thread = &t_list.threads[tid];
-        t_list.current = tid;
-        // Switch between thread contexts
-        ulthread_context_switch(&s_thread->context, &r_thread->context);
+        spins = 0;
+        switch_to(w, &w->context, r_thread);
+        w->current = NULL;
+        finish_switch(w);
     }
+    if (t_list.preempt_ticks)
+        sigalarm(0, 0);
+    preempt_on();
+}
+
+/* Thread scheduler */
+void ulthread_schedule(void) {
+    int started = 1;
+    for (int i = 1; i < t_list.nworkers; i++) {
+        if (start_worker(&t_list.workers[i]) < 0)
+            break;
+        started++;
+    }
+    t_list.nworkers = started;
+
+    worker_schedule(&t_list.workers[0]);
+
+    for (int i = 1; i < started; i++)
+        stop_worker(&t_list.workers[i]);
 }
 
 /* Yield CPU time to some other thread. */
 void ulthread_yield(void) {
-    printf("[*] ultyield(tid: %d)\n", t_list.current);
-    struct ulthread *c_thread = &t_list.threads[t_list.current];
+    preempt_off();
+    struct ulworker *w = myworker();
+    struct ulthread *c_thread = w->current;
+    trace_event(ULTRACE_YIELD, c_thread->tid, 0, 0);
+
+    struct ulthread *next = pick_next(w);
+    if (next == NULL) {
+        /* Nothing else is runnable, so keep running */
+        trace_event(ULTRACE_SCHEDULE, c_thread->tid, 0, 0);
+        preempt_on();
+        return;
+    }
     c_thread->state = YIELD;
-    t_list.yield_tid = t_list.current;
-    ulthread_context_switch(&c_thread->context, &t_list.threads[0].context);
+    w->yielded = c_thread;
+    switch_to(w, &c_thread->context, next);
+
+    /* Possibly resumed by another worker */
+    finish_switch(myworker());
+    preempt_on();
 }
 
 /* Destroy thread */
 void ulthread_destroy(void) {
-    printf("[*] ultdestroy(tid: %d)\n", t_list.current);
-    struct ulthread *c_thread = &t_list.threads[t_list.current];
+    preempt_off();
+    struct ulworker *w = myworker();
+    struct ulthread *c_thread = w->current;
+    trace_event(ULTRACE_DESTROY, c_thread->tid, 0, 0);
     c_thread->state = FREE;
-    t_list.total--;
-    ulthread_context_switch(&c_thread->context, &t_list.threads[0].context);
-}
\ No newline at end of file
+    w->exited = c_thread;
+    switch_away(w, c_thread);
+}
+
+/* Block the running thread on q. The caller holds lk, the lock
+ * protecting q, which is released only once the thread is off its
+ * stack: a waker must hold lk, so it can't make the thread runnable
+ * on another worker too early. Returns with lk released. */
+static void block_on(struct ulthread_queue *q, struct ulthread_lock *lk) {
+    struct ulworker *w = myworker();
+    struct ulthread *c_thread = w->current;
+    trace_event(ULTRACE_BLOCK, c_thread->tid, 0, 0);
+    c_thread->state = BLOCKED;
+    queue_push_back(q, c_thread);
+    w->unlock = lk;
+    switch_away(w, c_thread);
+
+    /* lk's preempt_off is carried across the switch */
+    finish_switch(myworker());
+    preempt_on();
+}
+
+/* Make the first thread waiting on q runnable, if any.
+ * Called with the lock protecting q held. */
+static struct ulthread *wake_one(struct ulthread_queue *q) {
+    struct ulthread *t = queue_pop(q);
+    if (t) {
+        struct ulworker *w = myworker();
+        t->state = RUNNABLE;
+        lock_acquire(&w->lock);
+        runq_push(w, t);
+        lock_release(&w->lock);
+    }
+    return t;
+}
+
+void ulthread_mutex_init(struct ulthread_mutex *m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void ulthread_mutex_lock(struct ulthread_mutex *m) {
+    lock_acquire(&m->lk);
+    if (!m->locked) {
+        m->locked = 1;
+        m->owner = myworker()->current;
+        lock_release(&m->lk);
+        return;
+    }
+    /* The unlocking thread hands the mutex over */
+    block_on(&m->waiters, &m->lk);
+}
+
+void ulthread_mutex_unlock(struct ulthread_mutex *m) {
+    lock_acquire(&m->lk);
+    struct ulthread *t = wake_one(&m->waiters);
+    m->owner = t;
+    if (t == NULL)
+        m->locked = 0;
+    lock_release(&m->lk);
+}
+
+void ulthread_cond_init(struct ulthread_cond *c) {
+    memset(c, 0, sizeof(*c));
+}
+
+/* Atomically release m and wait for c, then reacquire m. Taking
+ * c's lock first means a signal can't slip in between. */
+void ulthread_cond_wait(struct ulthread_cond *c, struct ulthread_mutex *m) {
+    lock_acquire(&c->lk);
+    ulthread_mutex_unlock(m);
+    block_on(&c->waiters, &c->lk);
+    ulthread_mutex_lock(m);
+}
+
+void ulthread_cond_signal(struct ulthread_cond *c) {
+    lock_acquire(&c->lk);
+    wake_one(&c->waiters);
+    lock_release(&c->lk);
+}
+
+void ulthread_cond_broadcast(struct ulthread_cond *c) {
+    lock_acquire(&c->lk);
+    while (wake_one(&c->waiters))
+        ;
+    lock_release(&c->lk);
+}
+
+void ulthread_sem_init(struct ulthread_sem *s, int count) {
+    memset(s, 0, sizeof(*s));
+    s->count = count;
+}
+
+void ulthread_sem_wait(struct ulthread_sem *s) {
+    lock_acquire(&s->lk);
+    if (s->count > 0) {
+        s->count--;
+        lock_release(&s->lk);
+        return;
+    }
+    /* ulthread_sem_post() hands its unit over to us */
+    block_on(&s->waiters, &s->lk);
+}
+
+void ulthread_sem_post(struct ulthread_sem *s) {
+    lock_acquire(&s->lk);
+    if (wake_one(&s->waiters) == NULL)
+        s->count++;
+    lock_release(&s->lk);
+}
+
+/* Channel holding up to cap values. Returns false if out of memory. */
+bool ulthread_chan_init(struct ulthread_chan *ch, int cap) {
+    memset(ch, 0, sizeof(*ch));
+    if (cap < 1)
+        cap = 1;
+    preempt_off();
+    ch->buf = malloc(cap * sizeof(uint64));
+    preempt_on();
+    ch->cap = cap;
+    return ch->buf != NULL;
+}
+
+void ulthread_chan_free(struct ulthread_chan *ch) {
+    preempt_off();
+    free(ch->buf);
+    preempt_on();
+    ch->buf = NULL;
+}
+
+/* Send v, waiting while the channel is full. */
+void ulthread_chan_send(struct ulthread_chan *ch, uint64 v) {
+    lock_acquire(&ch->lk);
+    while (ch->count == ch->cap) {
+        block_on(&ch->senders, &ch->lk);
+        lock_acquire(&ch->lk);
+    }
+    ch->buf[(ch->head + ch->count) % ch->cap] = v;
+    ch->count++;
+    wake_one(&ch->receivers);
+    lock_release(&ch->lk);
+}
+
+/* Receive the oldest value, waiting while the channel is empty. */
+uint64 ulthread_chan_recv(struct ulthread_chan *ch) {
+    lock_acquire(&ch->lk);
+    while (ch->count == 0) {
+        block_on(&ch->receivers, &ch->lk);
+        lock_acquire(&ch->lk);
+    }
+    uint64 v = ch->buf[ch->head];
+    ch->head = (ch->head + 1) % ch->cap;
+    ch->count--;
+    wake_one(&ch->senders);
+    lock_release(&ch->lk);
+    return v;
+}
+
+/* Wait until fd is ready for events, parking the running thread
+ * rather than blocking its worker in the kernel. Returns at once
+ * if fd is not open, so the caller's system call reports it. */
+static void wait_fd(int fd, int events) {
+    struct pollfd pfd;
+
+    if (myworker()->current == NULL)
+        return;
+    for (;;) {
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) != 0)
+            return;
+        lock_acquire(&t_list.io_lock);
+        struct ulthread *c_thread = myworker()->current;
+        c_thread->wait_fd = fd;
+        c_thread->wait_events = events;
+        t_list.nio++;
+        block_on(&t_list.io_waiters, &t_list.io_lock);
+    }
+}
+
+/* read() that lets other threads run while it waits for input */
+int ulthread_read(int fd, void *buf, int n) {
+    wait_fd(fd, POLLIN);
+    return read(fd, buf, n);
+}
+
+/* write() that lets other threads run while it waits for room.
+ * A write larger than the room available may still block. */
+int ulthread_write(int fd, const void *buf, int n) {
+    wait_fd(fd, POLLOUT);
+    return write(fd, buf, n);
+}
@@ -3,12 +3,22 @@
 
 #include <stdbool.h>
 
-#define MAXULTHREADS 100
+#define MAXULTHREADS 100        // limit for ulthread_create() with caller stacks
+#define ULTHREAD_STACKSIZE 4096 // default size of a pooled stack
+#define ULSTACK_NBUCKET 16      // pooled stacks up to this many pages are binned
+#define ULTHREAD_MAXWORKERS 8   // kernel execution contexts in M:N mode
+#define ULWORKER_STACKPAGES 4   // stack of a worker's scheduler loop
+#define ULTHREAD_NPRIO 64       // priority levels; higher runs first
+#define ULTHREAD_IOPOLL 16      // picks between polls for threads parked on I/O
+#define ULWORKER_IDLESPIN 64    // empty picks before an idle worker blocks
+#define ULTRACE_NREC 1024       // records kept by the trace ring, a power of two
+#define ULTRACE_MAGIC 0x52544c55 // "ULTR", first word of a trace dump
 
 enum ulthread_state {
   FREE,
   RUNNABLE,
   YIELD,
+  BLOCKED,      // waiting on a mutex, condition, semaphore, channel or fd
 };
 
 enum ulthread_scheduling_algorithm {
@@ -17,6 +27,37 @@ enum ulthread_scheduling_algorithm {
   FCFS,         // first-come-first serve
 };
 
+/* Where scheduling events go */
+enum ulthread_trace_mode {
+  TRACE_NONE,
+  TRACE_PRINTF, // one line per event on the console (the default)
+  TRACE_RING,   // binary records in memory, see ulthread_trace_dump()
+};
+
+enum ulthread_trace_event {
+  ULTRACE_CREATE,   // arg0: start function, arg1: stack
+  ULTRACE_SCHEDULE,
+  ULTRACE_YIELD,
+  ULTRACE_DESTROY,
+  ULTRACE_BLOCK,
+  ULTRACE_EXIT,     // scheduler found nothing to run
+};
+
+/* Trace ring record; a dump is a ulthread_trace_hdr followed by
+ * nrec of these, oldest first. */
+struct ulthread_trace_rec {
+  uint64 time;   // ctime() at the event
+  uint64 arg0;
+  uint64 arg1;
+  int tid;
+  int event;     // enum ulthread_trace_event
+};
+
+struct ulthread_trace_hdr {
+  uint magic;    // ULTRACE_MAGIC
+  uint nrec;     // records that follow
+};
+
 struct ulthread_context {
   uint64 ra;
   uint64 sp;
@@ -33,6 +74,7 @@ struct ulthread_context {
   uint64 s9;
   uint64 s10;
   uint64 s11;
+  // arguments, loaded once by ulthread_start
   uint64 a0;
   uint64 a1;
   uint64 a2;
@@ -45,19 +87,142 @@ struct ulthread {
   int tid;                     // Thread ID
   enum ulthread_state state;   // User-level thread state
   uint64 *stack;               // Virtual address of stack
+  uint64 stack_pages;          // Pages in a pooled stack, 0 if caller-owned
   struct ulthread_context context; // swtch() here to run thread
   uint64 *start_func;           // The start function of the thread
   char name[16];               // Thread name (debugging)
   int priority;                // Priority of the thread
-  int created_at;              // Thread creation time for FCFS
+  uint64 created_at;           // Thread creation time for FCFS
+  int wait_fd;                 // fd a thread parked on I/O waits for
+  int wait_events;             // POLLIN or POLLOUT
+  struct ulthread *next;       // Run queue links
+  struct ulthread *prev;
+};
+
+/* Spinlock shared by the workers of one address space */
+struct ulthread_lock {
+  uint locked;
+};
+
+/* Intrusive deque of threads, linked through ulthread.next/prev */
+struct ulthread_queue {
+  struct ulthread *head;
+  struct ulthread *tail;
+};
+
+/* Ready threads, organized so that picking the next one is O(1) */
+struct ulthread_runq {
+  struct ulthread_queue fifo;                  // ROUNDROBIN and FCFS
+  struct ulthread_queue prio[ULTHREAD_NPRIO];  // PRIORITY buckets
+  uint64 prio_map;                             // bit i set if prio[i] is non-empty
+};
+
+/* A recycled stack, stored at the lowest usable address of the stack */
+struct ulstack {
+  struct ulstack *next;
+  uint64 npages;
+};
+
+/* Per-worker scheduler state. A worker is one kernel execution
+ * context running its own scheduler loop over its own run queue. */
+struct ulworker {
+  uint preempt_off;                // upcalls deferred while non-zero; must stay first
+  int preempt_pending;             // an upcall was deferred
+  int id;                          // worker index
+  int pid;                         // kernel thread running this worker
+  uint64 stack;                    // top of the scheduler stack, 0 for worker 0
+  struct ulthread_lock lock;       // protects runq and nready
+  struct ulthread_runq runq;       // threads ready to run on this worker
+  int nready;                      // number of threads in runq
+  struct ulthread_context context; // scheduler loop, entered when nothing is runnable
+  struct ulthread *current;        // thread running on this worker, or null
+  struct ulthread *yielded;        // requeued once the next thread is picked
+  struct ulthread *exited;         // destroyed, but its stack was still in use
+  struct ulthread_lock *unlock;    // released once a blocking thread is switched out
+  uint npicks;                     // threads picked, to pace polling for I/O
 };
 
 struct ulthread_list {
   int total;                  // total number of threads currently
-  int current;                // index of the current thread
-  int yield_tid;              // keep track of the thread that is yielding
-  struct ulthread threads[MAXULTHREADS]; // array of threads
+  struct ulthread_lock lock;  // protects the thread table and stack pool
+  struct ulthread **threads;  // thread control blocks, indexed by tid
+  uint64 *tid_map;            // bit set for every tid in use
+  int capacity;               // number of slots in threads[]
+  struct ulstack *free_stacks[ULSTACK_NBUCKET+1]; // by page count, [0] for larger
+  int nworkers;               // workers started by ulthread_schedule()
+  int preempt_ticks;          // timer ticks per time slice, 0 for none
+  struct ulthread_lock io_lock;       // protects io_waiters and nio
+  struct ulthread_queue io_waiters;   // threads parked until their fd is ready
+  int nio;                            // number of threads in io_waiters
+  int wake_fd[2];             // pipe idle workers block reading
+  int nidle;                  // workers blocked, or about to block, on wake_fd
+  int kicked;                 // a byte is in wake_fd that no worker has read
+  struct ulworker workers[ULTHREAD_MAXWORKERS];
   enum ulthread_scheduling_algorithm algorithm; // The scheduling algorithm to use
 };
 
+/* Blocking synchronization. Waiters sleep on a wait queue, in
+ * FIFO order, off every run queue. All-zero is a valid unlocked
+ * mutex and an empty condition variable. */
+struct ulthread_mutex {
+  struct ulthread_lock lk;
+  int locked;
+  struct ulthread *owner;
+  struct ulthread_queue waiters;
+};
+
+struct ulthread_cond {
+  struct ulthread_lock lk;
+  struct ulthread_queue waiters;
+};
+
+struct ulthread_sem {
+  struct ulthread_lock lk;
+  int count;
+  struct ulthread_queue waiters;
+};
+
+/* Bounded channel of 64-bit values */
+struct ulthread_chan {
+  struct ulthread_lock lk;
+  uint64 *buf;
+  int cap;
+  int head;                         // index of the oldest value
+  int count;                        // values in buf
+  struct ulthread_queue senders;    // waiting for room
+  struct ulthread_queue receivers;  // waiting for a value
+};
+
+int get_current_tid(void);
+void ulthread_init(int schedalgo);
+void ulthread_init_mn(int schedalgo, int nworkers);
+bool ulthread_create(uint64 start, uint64 stack, uint64 args[], int priority);
+int ulthread_spawn(uint64 start, uint64 args[], int priority, uint64 stacksize);
+void ulthread_schedule(void);
+void ulthread_yield(void);
+void ulthread_destroy(void);
+void ulthread_preempt(int ticks);
+void ulthread_preempt_disable(void);
+void ulthread_preempt_enable(void);
+void ulthread_mutex_init(struct ulthread_mutex *m);
+void ulthread_mutex_lock(struct ulthread_mutex *m);
+void ulthread_mutex_unlock(struct ulthread_mutex *m);
+void ulthread_cond_init(struct ulthread_cond *c);
+void ulthread_cond_wait(struct ulthread_cond *c, struct ulthread_mutex *m);
+void ulthread_cond_signal(struct ulthread_cond *c);
+void ulthread_cond_broadcast(struct ulthread_cond *c);
+void ulthread_sem_init(struct ulthread_sem *s, int count);
+void ulthread_sem_wait(struct ulthread_sem *s);
+void ulthread_sem_post(struct ulthread_sem *s);
+bool ulthread_chan_init(struct ulthread_chan *ch, int cap);
+void ulthread_chan_free(struct ulthread_chan *ch);
+void ulthread_chan_send(struct ulthread_chan *ch, uint64 v);
+uint64 ulthread_chan_recv(struct ulthread_chan *ch);
+int ulthread_read(int fd, void *buf, int n);
+int ulthread_write(int fd, const void *buf, int n);
+void ulthread_trace(enum ulthread_trace_mode mode);
+int ulthread_trace_dump(int fd);
+void ulthread_context_switch(struct ulthread_context *from, struct ulthread_context *to);
+void ulthread_start(void);
+
 #endif
\ No newline at end of file
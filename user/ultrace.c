@@ -0,0 +1,65 @@
+// Decode a ulthread trace ring written by ulthread_trace_dump().
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "user/ulthread.h"
+
+char *names[] = {
+[ULTRACE_CREATE]    "create",
+[ULTRACE_SCHEDULE]  "schedule",
+[ULTRACE_YIELD]     "yield",
+[ULTRACE_DESTROY]   "destroy",
+[ULTRACE_BLOCK]     "block",
+[ULTRACE_EXIT]      "exit",
+};
+
+void
+ultrace(int fd, char *name)
+{
+  struct ulthread_trace_hdr hdr;
+  struct ulthread_trace_rec r;
+  uint64 t0 = 0;
+
+  if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != ULTRACE_MAGIC){
+    fprintf(2, "ultrace: %s is not a trace\n", name);
+    exit(1);
+  }
+  for(uint i = 0; i < hdr.nrec; i++){
+    if(read(fd, &r, sizeof(r)) != sizeof(r)){
+      fprintf(2, "ultrace: %s: short read\n", name);
+      exit(1);
+    }
+    if(i == 0)
+      t0 = r.time;
+    printf("%d\ttid %d\t", (int)(r.time - t0), r.tid);
+    if(r.event >= 0 && r.event < sizeof(names)/sizeof(names[0]) && names[r.event])
+      printf("%s", names[r.event]);
+    else
+      printf("event %d", r.event);
+    if(r.event == ULTRACE_CREATE)
+      printf("\tra %p sp %p", r.arg0, r.arg1);
+    printf("\n");
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i;
+
+  if(argc <= 1){
+    ultrace(0, "stdin");
+    exit(0);
+  }
+
+  for(i = 1; i < argc; i++){
+    if((fd = open(argv[i], 0)) < 0){
+      fprintf(2, "ultrace: cannot open %s\n", argv[i]);
+      exit(1);
+    }
+    ultrace(fd, argv[i]);
+    close(fd);
+  }
+  exit(0);
+}
@@ -21,8 +21,26 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
-void
-free(void *ap)
+// Threads created by clone() share the heap.
+static uint lock;
+
+static void
+acquire(void)
+{
+  while(__sync_lock_test_and_set(&lock, 1) != 0)
+    ;
+  __sync_synchronize();
+}
+
+static void
+release(void)
+{
+  __sync_synchronize();
+  __sync_lock_release(&lock);
+}
+
+static void
+freelocked(void *ap)
 {
   Header *bp, *p;
 
@@ -56,10 +74,18 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  freelocked((void*)(hp + 1));
   return freep;
 }
 
+void
+free(void *ap)
+{
+  acquire();
+  freelocked(ap);
+  release();
+}
+
 void*
 malloc(uint nbytes)
 {
@@ -67,6 +93,7 @@ malloc(uint nbytes)
   uint nunits;
 
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  acquire();
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -81,10 +108,13 @@ malloc(uint nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
+      release();
       return (void*)(p + 1);
     }
     if(p == freep)
-      if((p = morecore(nunits)) == 0)
+      if((p = morecore(nunits)) == 0){
+        release();
         return 0;
+      }
   }
 }
@@ -1,4 +1,5 @@
 struct stat;
+struct pollfd;
 
 // system calls
 int fork(void);
@@ -22,7 +23,16 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
-int ctime(void);
+uint64 ctime(void);
+int guardpage(void*);
+int clone(void(*)(void*), void*, void*);
+int join(void);
+int sigalarm(int, void(*)(uint64));
+int sigreturn(uint64);
+int poll(struct pollfd*, int, int);
+int setpriority(int, int);
+int getpriority(int);
+int nanosleep(uint64);
 
 // ulib.c
 int stat(const char*, struct stat*);
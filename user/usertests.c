@@ -113,6 +113,30 @@ copyout(char *s)
   }
 }
 
+// the kernel must not write into a read-only text page for us.
+void
+copyoutro(char *s)
+{
+  char before = *(char*)copyoutro;
+  int fds[2];
+
+  if(pipe(fds) < 0){
+    printf("pipe() failed\n");
+    exit(1);
+  }
+  if(write(fds[1], "x", 1) != 1){
+    printf("pipe write failed\n");
+    exit(1);
+  }
+  int n = read(fds[0], (void*)copyoutro, 1);
+  if(n > 0 || *(char*)copyoutro != before){
+    printf("%s: read() into text returned %d\n", s, n);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
 // what if you pass ridiculous string pointers to system calls?
 void
 copyinstr1(char *s)
@@ -2057,18 +2081,330 @@ sbrkbasic(char *s)
   exit(xstatus);
 }
 
+// fork a process with a big heap, sharing its pages
+// copy-on-write, and check that parent and child see only
+// their own writes.
+void
+cowfork(char *s)
+{
+  enum { BIG=(MAXHEAP/2)*4096 };
+  char *a, *p;
+  int i, pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 4096)
+    *p = 1;
+
+  for(i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(p = a; p < a + BIG; p += 64*1024){
+        if(*p != 1){
+          printf("%s: child saw parent write\n", s);
+          exit(1);
+        }
+        *p = 2;
+      }
+      // write() into a shared page goes through copyout()
+      int fds[2];
+      pipe(fds);
+      write(fds[1], "x", 1);
+      read(fds[0], a + 4096, 1);
+      if(a[4096] != 'x' || a[8192] != 1){
+        printf("%s: copyout into shared page failed\n", s);
+        exit(1);
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  for(p = a; p < a + BIG; p += 4096){
+    if(*p != 1){
+      printf("%s: parent saw child write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
+// pages of the program image are read in on first use,
+// including by the kernel copying into them.
+char lazybuf[16*4096];
+
+void
+lazyexec(char *s)
+{
+  int fds[2], pid, *xp;
+
+  xp = (int*)&lazybuf[15*4096];
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // read() copies out with the pipe lock held
+    pipe(fds);
+    write(fds[1], "y", 1);
+    if(read(fds[0], &lazybuf[4096], 1) != 1 || lazybuf[4096] != 'y'){
+      printf("%s: read into untouched page failed\n", s);
+      exit(1);
+    }
+    if(lazybuf[8*4096] != 0){
+      printf("%s: bss not zero\n", s);
+      exit(1);
+    }
+    exit(7);
+  }
+  if(wait(xp) != pid || *xp != 7){
+    printf("%s: wait status into untouched page failed\n", s);
+    exit(1);
+  }
+}
+
+// more heap than MAXRESHEAP pages, so some of it is
+// swapped out and back in.
+void
+swapheap(char *s)
+{
+  enum { NPAGES=300 };
+  char *a;
+  int i, pid, xstatus;
+
+  a = sbrk(NPAGES*4096);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NPAGES; i++)
+    a[i*4096] = i;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < NPAGES; i++){
+      if(a[i*4096] != (char)i){
+        printf("%s: child saw wrong page %d\n", s, i);
+        exit(1);
+      }
+      a[i*4096] = -i;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  // copyout() into a page that was swapped out
+  int fds[2];
+  pipe(fds);
+  write(fds[1], "z", 1);
+  read(fds[0], a + 1, 1);
+  close(fds[0]);
+  close(fds[1]);
+  if(a[1] != 'z'){
+    printf("%s: read into swapped page failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NPAGES; i++){
+    if(a[i*4096] != (char)i){
+      printf("%s: parent saw wrong page %d\n", s, i);
+      exit(1);
+    }
+  }
+
+  // pages swapped in clean keep their swap copy; writing
+  // them must not lose the new data when they go out again.
+  for(i = 0; i < NPAGES; i++)
+    a[i*4096] = i + 1;
+  for(i = 0; i < NPAGES; i++){
+    if(a[i*4096] != (char)(i + 1)){
+      printf("%s: lost write to page %d\n", s, i);
+      exit(1);
+    }
+  }
+  sbrk(-NPAGES*4096);
+}
+
+// sbrk() only reserves address space; pages are zero-filled
+// when first touched. The heap still can't grow past
+// MAXHEAP pages.
+void
+lazysbrk(char *s)
+{
+  enum { BIG=(MAXHEAP/2)*4096 };
+  char *a;
+  uint64 i;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk of unused memory failed\n", s);
+    exit(1);
+  }
+  if(sbrk(MAXHEAP*4096) != (char*)0xffffffffffffffffL){
+    printf("%s: heap grew past MAXHEAP pages\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG; i += 64*4096){
+    if(a[i] != 0){
+      printf("%s: new heap not zero\n", s);
+      exit(1);
+    }
+    a[i] = 1;
+  }
+  for(i = 0; i < BIG; i += 64*4096){
+    if(a[i] != 1){
+      printf("%s: lost write to heap\n", s);
+      exit(1);
+    }
+  }
+  if(sbrk(-BIG) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk could not shrink\n", s);
+    exit(1);
+  }
+}
+
+// setpriority()/getpriority() round-trip, are inherited by
+// fork(), and reject bad priorities and pids.
+void
+priority(char *s)
+{
+  int pid, xstatus, prio;
+
+  prio = getpriority(getpid());
+  if(prio < 0){
+    printf("%s: getpriority of self failed\n", s);
+    exit(1);
+  }
+  if(setpriority(getpid(), 0) < 0 || getpriority(getpid()) != 0){
+    printf("%s: setpriority 0 failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(getpriority(getpid()) == 0 ? 0 : 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not inherit priority\n", s);
+    exit(1);
+  }
+  if(setpriority(getpid(), -1) != -1 || setpriority(getpid(), 100) != -1){
+    printf("%s: bad priority accepted\n", s);
+    exit(1);
+  }
+  if(setpriority(1000000, 0) != -1 || getpriority(1000000) != -1){
+    printf("%s: bad pid accepted\n", s);
+    exit(1);
+  }
+  if(setpriority(getpid(), prio) < 0){
+    printf("%s: could not restore priority\n", s);
+    exit(1);
+  }
+}
+
+// nanosleep() and sleep() wait at least as long as asked,
+// and a killed sleeper wakes up.
+void
+timedsleep(char *s)
+{
+  uint64 t0;
+  int pid, xstatus;
+
+  t0 = ctime();
+  if(nanosleep(50*1000*1000) < 0 || ctime() - t0 < 500000){
+    printf("%s: nanosleep returned early\n", s);
+    exit(1);
+  }
+  // the tick rate is set at boot, so measure in ticks.
+  t0 = uptime();
+  if(sleep(2) < 0 || uptime() - t0 < 2){
+    printf("%s: sleep returned early\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    nanosleep(1000L*1000*1000*1000);
+    exit(0);
+  }
+  sleep(1);
+  kill(pid);
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: killed sleeper exited with %d\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// guardpage() on heap sbrk() hasn't allocated yet keeps
+// it from ever being accessible.
+void
+guardheap(char *s)
+{
+  char *a;
+  int pid, xstatus;
+
+  a = sbrk(2*4096);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  if(guardpage(a) < 0){
+    printf("%s: guardpage of untouched heap failed\n", s);
+    exit(1);
+  }
+  a[4096] = 1;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[0] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: guard page was writable\n", s);
+    exit(1);
+  }
+  sbrk(-2*4096);
+}
+
 void
 sbrkmuch(char *s)
 {
-  enum { BIG=100*1024*1024 };
   char *c, *oldbrk, *a, *lastaddr, *p;
-  uint64 amt;
+  uint64 amt, big;
 
   oldbrk = sbrk(0);
 
   // can one grow address space to something big?
+  // the heap can be at most MAXHEAP pages.
   a = sbrk(0);
-  amt = BIG - (uint64)a;
+  big = PGROUNDUP((uint64)a) + (MAXHEAP/2)*PGSIZE;
+  amt = big - (uint64)a;
   p = sbrk(amt);
   if (p != a) {
     printf("%s: sbrk test failed to grow big address space; enough phys mem?\n", s);
@@ -2080,7 +2416,7 @@ sbrkmuch(char *s)
   for(char *pp = a; pp < eee; pp += 4096)
     *pp = 1;
 
-  lastaddr = (char*) (BIG-1);
+  lastaddr = (char*) (big-1);
   *lastaddr = 99;
 
   // can one de-allocate?
@@ -2577,6 +2913,7 @@ struct test {
 } quicktests[] = {
   {copyin, "copyin"},
   {copyout, "copyout"},
+  {copyoutro, "copyoutro"},
   {copyinstr1, "copyinstr1"},
   {copyinstr2, "copyinstr2"},
   {copyinstr3, "copyinstr3"},
@@ -2620,6 +2957,13 @@ struct test {
   {forktest, "forktest"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
+  {cowfork, "cowfork"},
+  {lazyexec, "lazyexec"},
+  {swapheap, "swapheap"},
+  {lazysbrk, "lazysbrk"},
+  {guardheap, "guardheap"},
+  {priority, "priority"},
+  {timedsleep, "timedsleep"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
@@ -36,4 +36,13 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
-entry("ctime");
\ No newline at end of file
+entry("ctime");
+entry("guardpage");
+entry("clone");
+entry("join");
+entry("sigalarm");
+entry("sigreturn");
+entry("poll");
+entry("setpriority");
+entry("getpriority");
+entry("nanosleep");
\ No newline at end of file